@@ -0,0 +1,575 @@
+// Benchmark harness. Runs the renderer headless through a fixed set of scenarios, every scenario in its own
+// process so they can't influence each other and the peak memory use of each one can be measured. The results
+// are written as JSON, and can be compared against a stored baseline to fail on regressions.
+
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+namespace
+{
+    enum PipelineCache
+    {
+        CACHE_WARM, // Warmed with a one frame run of the scenario first
+        CACHE_COLD  // Removed first
+    };
+
+    struct Scenario
+    {
+        std::string name;
+        std::vector<std::string> arguments;
+        PipelineCache pipeline_cache;
+    };
+
+    // Flattened metrics, "<scenario>.<metric>" -> value
+    typedef std::map<std::string, double> Metrics;
+
+    // Separate from the renderer's own cache, so the cold scenario doesn't throw that away.
+    const char* PIPELINE_CACHE_PATH = "benchmark_pipeline_cache.bin";
+    const char* PROFILE_PATH = "benchmark_profile.json";
+
+#ifdef _WIN32
+    std::string renderer_path = "vulkan-triangle.exe";
+#else
+    std::string renderer_path = "./vulkan-triangle";
+#endif
+
+    // llvmpipe is the device name of lavapipe, which gives the same results on every machine.
+    std::string device_selection = "llvmpipe";
+    uint32_t frame_count = 1000;
+    std::string output_path = "benchmark_results.json";
+    std::string baseline_path;
+    double threshold = 0.10;
+    std::vector<std::string> selected_scenarios;
+
+    std::vector<Scenario> scenarios()
+    {
+        return {
+            {"triangle", {}, CACHE_WARM},
+            {"instances_100k", {"--instances", "100000"}, CACHE_WARM},
+            {"draw_calls_10k", {"--instances", "10000", "--draw-calls", "10000"}, CACHE_WARM},
+            {"overdraw", {"--instances", "10000", "--draw-calls", "1000", "--overlap", "8"}, CACHE_WARM},
+            {"overdraw_sorted", {"--instances", "10000", "--draw-calls", "1000", "--overlap", "8", "--sort-front-to-back"}, CACHE_WARM},
+            {"msaa_1", {"--instances", "10000", "--msaa", "1"}, CACHE_WARM},
+            {"msaa_2", {"--instances", "10000", "--msaa", "2"}, CACHE_WARM},
+            {"msaa_4", {"--instances", "10000", "--msaa", "4"}, CACHE_WARM},
+            {"msaa_8", {"--instances", "10000", "--msaa", "8"}, CACHE_WARM},
+            {"resize_storm", {"--resize-every", "10"}, CACHE_WARM},
+            {"pipeline_cold", {}, CACHE_COLD},
+            {"pipeline_warm", {}, CACHE_WARM}
+        };
+    }
+
+    /* #region JSON */
+
+    // Just enough JSON to read back the profiler output and the baselines: nested objects are flattened into dotted
+    // keys, numbers are kept, and everything else (strings, booleans, arrays) is skipped.
+    class JsonReader
+    {
+    public:
+        explicit JsonReader(const std::string& text) : text(text) {}
+
+        Metrics read()
+        {
+            Metrics values;
+            read_value("", values);
+            return values;
+        }
+
+    private:
+        const std::string& text;
+        size_t position = 0;
+
+        void skip_whitespace()
+        {
+            while (position < text.size() && std::isspace(static_cast<unsigned char>(text[position]))) position++;
+        }
+
+        char peek()
+        {
+            skip_whitespace();
+            if (position >= text.size()) throw std::runtime_error("Unexpected end of JSON!");
+            return text[position];
+        }
+
+        void expect(char c)
+        {
+            if (peek() != c) throw std::runtime_error(std::string("Expected '") + c + "' in JSON!");
+            position++;
+        }
+
+        std::string read_string()
+        {
+            expect('"');
+
+            std::string result;
+            while (position < text.size() && text[position] != '"')
+            {
+                if (text[position] == '\\') position++;
+                if (position < text.size()) result += text[position++];
+            }
+
+            expect('"');
+            return result;
+        }
+
+        void read_value(const std::string& key, Metrics& values)
+        {
+            char c = peek();
+
+            if (c == '{')
+            {
+                position++;
+                if (peek() == '}')
+                {
+                    position++;
+                    return;
+                }
+
+                while (true)
+                {
+                    std::string member = read_string();
+                    expect(':');
+                    read_value(key.empty() ? member : key + "." + member, values);
+
+                    if (peek() == ',')
+                    {
+                        position++;
+                        continue;
+                    }
+
+                    expect('}');
+                    return;
+                }
+            }
+            else if (c == '[')
+            {
+                position++;
+                if (peek() == ']')
+                {
+                    position++;
+                    return;
+                }
+
+                Metrics ignored;
+                while (true)
+                {
+                    read_value("", ignored);
+                    if (peek() == ',')
+                    {
+                        position++;
+                        continue;
+                    }
+
+                    expect(']');
+                    return;
+                }
+            }
+            else if (c == '"')
+            {
+                read_string();
+            }
+            else if (c == '-' || std::isdigit(static_cast<unsigned char>(c)))
+            {
+                size_t length = 0;
+                values[key] = std::stod(text.substr(position), &length);
+                position += length;
+            }
+            else
+            {
+                // true, false or null
+                while (position < text.size() && std::isalpha(static_cast<unsigned char>(text[position]))) position++;
+            }
+        }
+    };
+
+    Metrics read_json_file(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file.is_open()) throw std::runtime_error("Failed to open file " + path);
+
+        std::stringstream stream;
+        stream << file.rdbuf();
+
+        std::string text = stream.str();
+        return JsonReader(text).read();
+    }
+
+    /* #endregion */
+
+    /* #region Processes */
+
+    struct ProcessResult
+    {
+        int exit_code;
+        double peak_rss_kb;
+        double wall_ms;
+    };
+
+    ProcessResult run_process(const std::vector<std::string>& command)
+    {
+        ProcessResult result {};
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+#ifdef _WIN32
+        std::string command_line;
+        for (const std::string& argument : command) command_line += "\"" + argument + "\" ";
+
+        STARTUPINFOA startup_info {};
+        startup_info.cb = sizeof(startup_info);
+        PROCESS_INFORMATION process_info {};
+
+        if (!CreateProcessA(nullptr, &command_line[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup_info, &process_info))
+        {
+            throw std::runtime_error("Failed to start " + command[0]);
+        }
+
+        WaitForSingleObject(process_info.hProcess, INFINITE);
+
+        DWORD exit_code = 0;
+        GetExitCodeProcess(process_info.hProcess, &exit_code);
+        result.exit_code = static_cast<int>(exit_code);
+
+        PROCESS_MEMORY_COUNTERS memory_counters {};
+        if (GetProcessMemoryInfo(process_info.hProcess, &memory_counters, sizeof(memory_counters)))
+        {
+            result.peak_rss_kb = memory_counters.PeakWorkingSetSize / 1024.0;
+        }
+
+        CloseHandle(process_info.hThread);
+        CloseHandle(process_info.hProcess);
+#else
+        std::vector<char*> arguments;
+        for (const std::string& argument : command) arguments.push_back(const_cast<char*>(argument.c_str()));
+        arguments.push_back(nullptr);
+
+        pid_t pid = fork();
+        if (pid < 0) throw std::runtime_error("Failed to fork!");
+
+        if (pid == 0)
+        {
+            execv(arguments[0], arguments.data());
+            _exit(127); // Only reached if exec failed
+        }
+
+        int status = 0;
+        struct rusage usage {};
+        if (wait4(pid, &status, 0, &usage) < 0) throw std::runtime_error("Failed to wait for " + command[0]);
+
+        result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    #ifdef __APPLE__
+        result.peak_rss_kb = usage.ru_maxrss / 1024.0; // Bytes on macOS
+    #else
+        result.peak_rss_kb = static_cast<double>(usage.ru_maxrss);
+    #endif
+#endif
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+        result.wall_ms = elapsed.count();
+
+        return result;
+    }
+
+    /* #endregion */
+
+    bool is_selected(const Scenario& scenario)
+    {
+        if (selected_scenarios.empty()) return true;
+
+        for (const std::string& name : selected_scenarios)
+        {
+            if (name == scenario.name) return true;
+        }
+
+        return false;
+    }
+
+    std::vector<std::string> renderer_command(const Scenario& scenario, uint32_t frames)
+    {
+        std::vector<std::string> command = {renderer_path, "--headless", "--frames", std::to_string(frames),
+            "--pipeline-cache", PIPELINE_CACHE_PATH};
+        if (!device_selection.empty() && device_selection != "any")
+        {
+            command.push_back("--device");
+            command.push_back(device_selection);
+        }
+        command.insert(command.end(), scenario.arguments.begin(), scenario.arguments.end());
+
+        return command;
+    }
+
+    // Runs the scenario and adds its metrics. Returns false if the renderer failed.
+    bool run_scenario(const Scenario& scenario, Metrics& results)
+    {
+        std::cout << "=== " << scenario.name << " ===" << std::endl;
+
+        if (scenario.pipeline_cache == CACHE_COLD)
+        {
+            std::remove(PIPELINE_CACHE_PATH);
+        }
+        else
+        {
+            // Every scenario has its own pipeline state, so the cache is warmed with exactly that, whatever ran before.
+            ProcessResult warm_up = run_process(renderer_command(scenario, 1));
+            if (warm_up.exit_code != 0)
+            {
+                std::cout << "Warming the pipeline cache for " << scenario.name << " failed with exit code " << warm_up.exit_code << std::endl;
+                return false;
+            }
+        }
+
+        std::remove(PROFILE_PATH);
+
+        std::vector<std::string> command = renderer_command(scenario, frame_count);
+        command.push_back("--profile-output");
+        command.push_back(PROFILE_PATH);
+
+        ProcessResult process = run_process(command);
+
+        if (process.exit_code != 0)
+        {
+            std::cout << "Scenario " << scenario.name << " failed with exit code " << process.exit_code << std::endl;
+            return false;
+        }
+
+        Metrics profile = read_json_file(PROFILE_PATH);
+        auto copy = [&](const std::string& from, const std::string& to) {
+            Metrics::const_iterator value = profile.find(from);
+            if (value != profile.end()) results[scenario.name + "." + to] = value->second;
+        };
+
+        copy("metrics.fps", "fps");
+        copy("phases.frame.mean_ms", "frame_mean_ms");
+        copy("phases.frame.p50_ms", "frame_p50_ms");
+        copy("phases.frame.p95_ms", "frame_p95_ms");
+        copy("phases.frame.p99_ms", "frame_p99_ms");
+        copy("metrics.startup_ms", "startup_ms");
+        copy("metrics.first_frame_ms", "first_frame_ms");
+        copy("metrics.shader_load_ms", "shader_load_ms");
+        copy("metrics.pipeline_ms", "pipeline_ms");
+        copy("metrics.resize_mean_ms", "resize_mean_ms");
+        copy("metrics.resize_max_ms", "resize_max_ms");
+        copy("statistics.vertex_shader_invocations", "vertex_shader_invocations");
+        copy("statistics.clipping_primitives", "clipping_primitives");
+        copy("statistics.fragment_shader_invocations", "fragment_shader_invocations");
+        // Multisampled color and depth memory per frame. Unless it's lazily allocated, all of it is written and read back every frame.
+        copy("metrics.render_target_kb", "render_target_kb");
+
+        results[scenario.name + ".peak_rss_kb"] = process.peak_rss_kb;
+        results[scenario.name + ".wall_ms"] = process.wall_ms;
+
+        return true;
+    }
+
+    void write_results(const Metrics& results)
+    {
+        std::ofstream file(output_path, std::ios::trunc);
+        if (!file.is_open()) throw std::runtime_error("Failed to open file " + output_path);
+
+        file << "{\n  \"device\": \"" << device_selection << "\",\n  \"frames\": " << frame_count << ",\n  \"scenarios\": {";
+
+        // The keys are sorted, so the metrics of a scenario are next to each other.
+        std::string current_scenario;
+        for (const std::pair<const std::string, double>& result : results)
+        {
+            size_t separator = result.first.find('.');
+            std::string scenario = result.first.substr(0, separator);
+
+            if (scenario != current_scenario)
+            {
+                file << (current_scenario.empty() ? "\n" : "\n    },\n") << "    \"" << scenario << "\": {\n";
+                current_scenario = scenario;
+            }
+            else
+            {
+                file << ",\n";
+            }
+
+            file << "      \"" << result.first.substr(separator + 1) << "\": " << result.second;
+        }
+
+        if (!current_scenario.empty()) file << "\n    }";
+        file << "\n  }\n}\n";
+    }
+
+    bool ends_with(const std::string& text, const std::string& suffix)
+    {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // Frame rates are better when higher, everything else (times and memory) when lower.
+    bool higher_is_better(const std::string& metric)
+    {
+        return ends_with(metric, ".fps");
+    }
+
+    struct GatedMetric
+    {
+        const char* suffix;
+        double floor; // Changes smaller than this (in the metric's unit) never fail, whatever the relative change
+    };
+
+    // Metrics that fail the comparison. The startup times are often only a few milliseconds, so they get a floor
+    // that keeps scheduling noise from failing the run. Wall time and memory use vary too much, they are only reported.
+    const GatedMetric GATED_METRICS[] = {
+        {".fps", 0.0},
+        {".frame_mean_ms", 0.05},
+        {".frame_p50_ms", 0.05},
+        {".frame_p95_ms", 0.05},
+        {".frame_p99_ms", 0.05},
+        {".startup_ms", 5.0},
+        {".shader_load_ms", 1.0},
+        {".pipeline_ms", 2.0},
+        {".vertex_shader_invocations", 0.0},
+        {".clipping_primitives", 0.0},
+        {".fragment_shader_invocations", 0.0}
+    };
+
+    // Returns nullptr for metrics that are only reported.
+    const GatedMetric* find_gated_metric(const std::string& metric)
+    {
+        for (const GatedMetric& gated_metric : GATED_METRICS)
+        {
+            if (ends_with(metric, gated_metric.suffix)) return &gated_metric;
+        }
+
+        return nullptr;
+    }
+
+    // Returns the number of metrics that regressed by more than the threshold and their floor.
+    uint32_t compare_to_baseline(const Metrics& results)
+    {
+        Metrics baseline = read_json_file(baseline_path);
+        uint32_t regressions = 0;
+
+        std::cout << "Comparing against " << baseline_path << " (threshold " << threshold * 100.0 << "%):" << std::endl;
+
+        for (const std::pair<const std::string, double>& result : results)
+        {
+            Metrics::const_iterator base = baseline.find("scenarios." + result.first);
+            if (base == baseline.end() || base->second <= 0.0) continue;
+
+            double change = (result.second - base->second) / base->second;
+            const GatedMetric* gated = find_gated_metric(result.first);
+
+            bool regressed = false;
+            if (gated != nullptr && std::abs(result.second - base->second) > gated->floor)
+            {
+                regressed = higher_is_better(result.first) ? change < -threshold : change > threshold;
+            }
+
+            if (regressed) regressions++;
+
+            std::cout << (regressed ? "  REGRESSION " : "  ") << result.first << ": " << base->second << " -> "
+                << result.second << " (" << (change >= 0.0 ? "+" : "") << change * 100.0 << "%)"
+                << (gated != nullptr ? "" : ", not gated") << std::endl;
+        }
+
+        return regressions;
+    }
+
+    void print_usage()
+    {
+        std::cout << "Usage: vulkan-triangle-bench [options]\n"
+            << "  --renderer <path>      renderer executable (default " << renderer_path << ")\n"
+            << "  --device <selection>   device index, UUID or name, \"any\" picks the best one (default llvmpipe)\n"
+            << "  --frames <count>       frames rendered per scenario (default 1000)\n"
+            << "  --scenario <name>      only run this scenario, can be repeated\n"
+            << "  --output <path>        results file (default benchmark_results.json)\n"
+            << "  --baseline <path>      results to compare against, fails on regressions\n"
+            << "  --threshold <fraction> allowed regression (default 0.10)\n"
+            << "  --list                 list the scenarios" << std::endl;
+    }
+
+    // Returns false if the harness should exit without running.
+    bool parse_arguments(int argc, char** argv)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string argument = argv[i];
+
+            if (argument == "--renderer" && i + 1 < argc) renderer_path = argv[++i];
+            else if (argument == "--device" && i + 1 < argc) device_selection = argv[++i];
+            else if (argument == "--frames" && i + 1 < argc) frame_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+            else if (argument == "--scenario" && i + 1 < argc) selected_scenarios.push_back(argv[++i]);
+            else if (argument == "--output" && i + 1 < argc) output_path = argv[++i];
+            else if (argument == "--baseline" && i + 1 < argc) baseline_path = argv[++i];
+            else if (argument == "--threshold" && i + 1 < argc) threshold = std::stod(argv[++i]);
+            else if (argument == "--list")
+            {
+                for (const Scenario& scenario : scenarios()) std::cout << scenario.name << std::endl;
+                return false;
+            }
+            else if (argument == "--help")
+            {
+                print_usage();
+                return false;
+            }
+            else
+            {
+                throw std::runtime_error("Unknown argument " + argument);
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        if (!parse_arguments(argc, argv)) return EXIT_SUCCESS;
+
+        Metrics results;
+        bool failed = false;
+
+        // Left over from an earlier run, the scenarios decide themselves whether they start cold or warm.
+        std::remove(PIPELINE_CACHE_PATH);
+
+        for (const Scenario& scenario : scenarios())
+        {
+            if (is_selected(scenario) && !run_scenario(scenario, results)) failed = true;
+        }
+
+        std::remove(PROFILE_PATH);
+
+        write_results(results);
+        std::cout << "Results written to " << output_path << std::endl;
+
+        if (!baseline_path.empty() && compare_to_baseline(results) > 0)
+        {
+            std::cout << "Performance regressed beyond the threshold." << std::endl;
+            failed = true;
+        }
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,21 @@
+# Converts compiled SPIR-V files into a header with one uint32_t array per shader.
+# Usage: cmake -DOUTPUT=<header> -DINPUTS="name=file.spv;name=file.spv" -P embed_spirv.cmake
+
+set(HEADER_CONTENT "#pragma once\n\n#include <cstdint>\n\n// Generated by cmake/embed_spirv.cmake, do not edit.\nnamespace em_embedded_shaders\n{\n")
+
+foreach(INPUT ${INPUTS})
+    string(REPLACE "=" ";" INPUT_PARTS ${INPUT})
+    list(GET INPUT_PARTS 0 SHADER_NAME)
+    list(GET INPUT_PARTS 1 SHADER_FILE)
+
+    file(READ ${SHADER_FILE} SHADER_HEX HEX)
+
+    # SPIR-V is a stream of little endian 32-bit words.
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])" "0x\\4\\3\\2\\1, " SHADER_WORDS "${SHADER_HEX}")
+
+    string(APPEND HEADER_CONTENT "    const uint32_t ${SHADER_NAME}_spv[] = { ${SHADER_WORDS}};\n")
+endforeach()
+
+string(APPEND HEADER_CONTENT "}\n")
+
+file(WRITE ${OUTPUT} "${HEADER_CONTENT}")
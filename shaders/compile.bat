@@ -1,3 +1,4 @@
 glslc triangle.vert -o vert.spv
 glslc triangle.frag -o frag.spv
+glslc cull.comp -o cull.spv
 pause
\ No newline at end of file
@@ -1,2 +1,3 @@
 glslc triangle.vert -o vert.spv
-glslc triangle.frag -o frag.spv
\ No newline at end of file
+glslc triangle.frag -o frag.spv
+glslc cull.comp -o cull.spv
\ No newline at end of file
@@ -1,21 +1,48 @@
 #version 450
 
-vec2 positions[3] = vec2[](
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
-
-vec3 colors[3] = vec3[](
-    vec3(1.0, 0.0, 0.0),
-    vec3(0.0, 1.0, 0.0),
-    vec3(0.0, 0.0, 1.0)
-);
+layout(location = 0) in vec2 in_position;
+layout(location = 1) in vec3 in_color;
+
+// Per-instance attributes
+layout(location = 2) in vec2 instance_offset;
+layout(location = 3) in float instance_scale;
+layout(location = 4) in float instance_depth; // Reverse-Z, 1 is the nearest
+layout(location = 5) in uint instance_draw; // Draw call (object) the instance belongs to
+
+struct DrawUniforms
+{
+    vec4 tint;
+    float rotation;
+};
+
+// The uniforms of every draw call: a buffer written once without --animate, otherwise this frame's copy in the frame
+// ring buffer (selected with the dynamic offset), written by the CPU or by the culling shader.
+// Indexed with the instance's draw call, so CPU recorded and indirect draws read the same uniforms.
+layout(std430, set = 0, binding = 0) readonly buffer Draws
+{
+    DrawUniforms draws[];
+};
+
+layout(push_constant) uniform FrameConstants
+{
+    float time;
+    float zoom;
+} frame;
 
 layout(location = 0) out vec3 frag_color;
 
 void main()
 {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    frag_color = colors[gl_VertexIndex];
+    DrawUniforms draw = draws[instance_draw];
+
+    float s = sin(draw.rotation);
+    float c = cos(draw.rotation);
+    vec2 position = mat2(c, s, -s, c) * in_position;
+
+    // Pulses while animating, time stays 0 otherwise.
+    float pulse = 1.0 + 0.1 * sin(frame.time * 2.0);
+
+    vec2 world_position = position * instance_scale * pulse + instance_offset;
+    gl_Position = vec4(world_position * frame.zoom, instance_depth, 1.0);
+    frag_color = in_color * draw.tint.rgb;
 }
@@ -0,0 +1,54 @@
+#include "allocation_counter.hpp"
+
+#ifdef EM_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<uint64_t> allocation_count {0};
+}
+
+void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    void* pointer = std::malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr) throw std::bad_alloc();
+
+    return pointer;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t size) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t size) noexcept
+{
+    std::free(pointer);
+}
+
+uint64_t em_allocations::count()
+{
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+#endif
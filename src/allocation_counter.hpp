@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts the heap allocations made through operator new. Only available in builds configured with
+// EM_COUNT_ALLOCATIONS, which replace the global operator new/delete.
+namespace em_allocations
+{
+    uint64_t count();
+}
@@ -0,0 +1,136 @@
+#include "frame_pacer.hpp"
+
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+namespace
+{
+    // The timer wakes up a little before the deadline, the rest is spun away. Covers the wake up latency of the scheduler.
+    const std::chrono::microseconds SPIN_MARGIN(200);
+
+    double fps = 0.0;
+    std::chrono::steady_clock::duration frame_interval {};
+    std::chrono::steady_clock::time_point next_deadline;
+
+#ifdef _WIN32
+    HANDLE timer = nullptr;
+#endif
+
+    // Statistics
+    uint64_t paced_frames = 0;
+    uint64_t missed_deadlines = 0;
+    double total_sleep_ms = 0.0;
+    double total_oversleep_ms = 0.0;
+
+    void sleep_until(std::chrono::steady_clock::time_point wake_time)
+    {
+        std::chrono::steady_clock::duration remaining = wake_time - std::chrono::steady_clock::now();
+        if (remaining <= std::chrono::steady_clock::duration::zero()) return;
+
+#ifdef _WIN32
+        if (timer != nullptr)
+        {
+            // Relative due time in 100 ns units.
+            LARGE_INTEGER due_time;
+            due_time.QuadPart = -static_cast<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count() / 100);
+
+            if (SetWaitableTimer(timer, &due_time, 0, nullptr, nullptr, FALSE))
+            {
+                WaitForSingleObject(timer, INFINITE);
+                return;
+            }
+        }
+
+        std::this_thread::sleep_for(remaining);
+#else
+        // Sleeping until an absolute time isn't cut short by the time spent getting here.
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int64_t wake_ns = now.tv_sec * 1000000000LL + now.tv_nsec +
+            std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+
+        struct timespec wake {};
+        wake.tv_sec = static_cast<time_t>(wake_ns / 1000000000LL);
+        wake.tv_nsec = static_cast<long>(wake_ns % 1000000000LL);
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr) != 0) {} // Interrupted by a signal
+#endif
+    }
+}
+
+void em_frame_pacer::set_target_fps(double target)
+{
+    fps = target > 0.0 ? target : 0.0;
+    if (fps > 0.0)
+    {
+        frame_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+    }
+}
+
+double em_frame_pacer::target_fps()
+{
+    return fps;
+}
+
+void em_frame_pacer::start()
+{
+    next_deadline = std::chrono::steady_clock::now();
+
+#ifdef _WIN32
+    // High resolution timers are available since Windows 10 1803, older versions get a regular timer.
+    timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (timer == nullptr) timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+#endif
+}
+
+void em_frame_pacer::stop()
+{
+#ifdef _WIN32
+    if (timer != nullptr) CloseHandle(timer);
+    timer = nullptr;
+#endif
+}
+
+void em_frame_pacer::wait_for_next_frame()
+{
+    if (fps <= 0.0) return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    next_deadline += frame_interval;
+    paced_frames++;
+
+    // Too late already, start the schedule over from now.
+    if (next_deadline <= now)
+    {
+        missed_deadlines++;
+        next_deadline = now;
+        return;
+    }
+
+    sleep_until(next_deadline - SPIN_MARGIN);
+    while (std::chrono::steady_clock::now() < next_deadline) std::this_thread::yield();
+
+    std::chrono::steady_clock::time_point wake_time = std::chrono::steady_clock::now();
+    total_sleep_ms += std::chrono::duration<double, std::milli>(wake_time - now).count();
+    total_oversleep_ms += std::chrono::duration<double, std::milli>(wake_time - next_deadline).count();
+}
+
+void em_frame_pacer::print_statistics(std::ostream& stream)
+{
+    if (fps <= 0.0 || paced_frames == 0) return;
+
+    uint64_t slept_frames = paced_frames - missed_deadlines;
+
+    stream << "Frame pacing at " << fps << " fps: " << missed_deadlines << " of " << paced_frames << " frames started late, "
+        << "mean sleep " << total_sleep_ms / paced_frames << " ms, "
+        << "mean oversleep " << (slept_frames > 0 ? total_oversleep_ms / slept_frames : 0.0) << " ms" << std::endl;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+// Caps the frame rate by sleeping until the start of the next frame. The sleep is done with a high
+// resolution timer and finished with a short spin, so frames start close to their deadline without
+// keeping a core busy.
+namespace em_frame_pacer
+{
+    // 0 disables the cap, wait_for_next_frame() then returns immediately.
+    void set_target_fps(double fps);
+    double target_fps();
+
+    void start();
+    void stop();
+
+    // Blocks until the next frame is due. Deadlines are a fixed interval apart, a frame that started too late
+    // doesn't make the following frames start early to catch up.
+    void wait_for_next_frame();
+
+    void print_statistics(std::ostream& stream);
+}
@@ -0,0 +1,90 @@
+#include "frame_ring.hpp"
+
+#include "memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+namespace
+{
+    VkDevice device;
+
+    VkBuffer ring_buffer = VK_NULL_HANDLE;
+    em_memory::Allocation ring_memory;
+
+    VkDeviceSize alignment = 256;
+    VkDeviceSize partition_size = 0;
+
+    VkDeviceSize partition_start = 0;
+    std::atomic<VkDeviceSize> partition_used {0};
+
+    VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize multiple)
+    {
+        return (value + multiple - 1) & ~(multiple - 1);
+    }
+}
+
+void em_frame_ring::init(VkPhysicalDevice physical_device, VkDevice device_handle, uint32_t frames_in_flight, VkDeviceSize bytes_per_frame)
+{
+    device = device_handle;
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(physical_device, &device_properties);
+
+    // Always powers of two. The data is bound as uniform or storage buffers.
+    alignment = std::max(device_properties.limits.minUniformBufferOffsetAlignment, device_properties.limits.minStorageBufferOffsetAlignment);
+    partition_size = align_up(bytes_per_frame, alignment);
+
+    VkBufferCreateInfo buffer_info {};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = partition_size * frames_in_flight;
+    buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (vkCreateBuffer(device, &buffer_info, nullptr, &ring_buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create frame ring buffer!");
+    }
+
+    // Host visible memory is persistently mapped by the arena.
+    ring_memory = em_memory::allocate_buffer(ring_buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+}
+
+void em_frame_ring::destroy()
+{
+    if (ring_buffer == VK_NULL_HANDLE) return;
+
+    vkDestroyBuffer(device, ring_buffer, nullptr);
+    em_memory::free(ring_memory);
+
+    ring_buffer = VK_NULL_HANDLE;
+}
+
+void em_frame_ring::begin_frame(uint32_t frame)
+{
+    partition_start = partition_size * frame;
+    partition_used = 0;
+}
+
+em_frame_ring::Slice em_frame_ring::allocate(VkDeviceSize size)
+{
+    VkDeviceSize aligned_size = align_up(size, alignment);
+    VkDeviceSize offset = partition_used.fetch_add(aligned_size);
+
+    if (offset + aligned_size > partition_size)
+    {
+        throw std::runtime_error("Frame ring buffer partition is full!");
+    }
+
+    Slice slice;
+    slice.offset = static_cast<uint32_t>(partition_start + offset);
+    slice.data = static_cast<char*>(ring_memory.mapped) + partition_start + offset;
+
+    return slice;
+}
+
+VkBuffer em_frame_ring::buffer()
+{
+    return ring_buffer;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+
+// Persistently mapped, host coherent ring buffer for data that changes every frame (per draw uniforms).
+// The buffer is split into one partition per frame in flight. Each frame bump allocates from its own
+// partition, which is reused once the frame that last used it has finished, so writing the data never
+// allocates or maps memory. Allocating is thread safe, so worker threads can use it while recording.
+namespace em_frame_ring
+{
+    struct Slice
+    {
+        void* data;
+        uint32_t offset; // Offset in the buffer, used as the dynamic offset when binding
+    };
+
+    void init(VkPhysicalDevice physical_device, VkDevice device, uint32_t frames_in_flight, VkDeviceSize bytes_per_frame);
+    void destroy();
+
+    // Starts allocating from the start of the frame's partition. Only call this once the previous frame
+    // using the partition has finished.
+    void begin_frame(uint32_t frame);
+
+    // Offsets are aligned to minUniformBufferOffsetAlignment and minStorageBufferOffsetAlignment. Throws if the frame's partition is full.
+    Slice allocate(VkDeviceSize size);
+
+    template <typename T>
+    uint32_t push(const T& value)
+    {
+        Slice slice = allocate(sizeof(T));
+        *static_cast<T*>(slice.data) = value;
+        return slice.offset;
+    }
+
+    VkBuffer buffer();
+}
@@ -0,0 +1,417 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    // Smallest buddy handed out, smaller requests are rounded up to this.
+    const VkDeviceSize MIN_ALLOCATION_SIZE = 256;
+
+    struct Block
+    {
+        VkDeviceMemory memory;
+        void* mapped;
+
+        // One bit per buddy, set while it's free. Level 0 is the whole block and every next level halves the size,
+        // level L starts at bit 2^L - 1. Sized when the block is created, so allocating and freeing never use the heap.
+        std::vector<uint64_t> free_bits;
+        std::vector<uint32_t> free_counts; // Free buddies per level
+
+        VkDeviceSize allocated_bytes; // Sum of the buddy sizes handed out
+        VkDeviceSize requested_bytes; // Sum of the sizes actually requested
+    };
+
+    struct Pool
+    {
+        uint32_t memory_type;
+        em_memory::ResourceKind kind;
+        VkDeviceSize block_size;
+        uint32_t level_count;
+        std::vector<Block> blocks;
+    };
+
+    VkPhysicalDevice physical_device;
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    uint32_t max_allocation_count;
+    VkDeviceSize preferred_block_size;
+
+    std::vector<Pool> pools;
+    std::mutex arena_mutex;
+
+    // Statistics
+    uint32_t device_allocation_count = 0;
+    uint32_t dedicated_allocation_count = 0;
+    VkDeviceSize dedicated_bytes = 0;
+
+    VkDeviceSize round_up_to_power_of_two(VkDeviceSize value)
+    {
+        VkDeviceSize result = 1;
+        while (result < value) result <<= 1;
+        return result;
+    }
+
+    VkDeviceSize level_size(const Pool& pool, uint32_t level)
+    {
+        return pool.block_size >> level;
+    }
+
+    VkDeviceMemory allocate_device_memory(VkDeviceSize size, uint32_t memory_type, void** mapped)
+    {
+        if (device_allocation_count >= max_allocation_count)
+        {
+            throw std::runtime_error("Exceeded maxMemoryAllocationCount!");
+        }
+
+        VkMemoryAllocateInfo alloc_info {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.allocationSize = size;
+        alloc_info.memoryTypeIndex = memory_type;
+
+        VkDeviceMemory memory;
+        if (vkAllocateMemory(device, &alloc_info, nullptr, &memory) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate device memory!");
+        }
+
+        *mapped = nullptr;
+        if (memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        {
+            vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, mapped);
+        }
+
+        device_allocation_count++;
+        return memory;
+    }
+
+    void free_device_memory(VkDeviceMemory memory, void* mapped)
+    {
+        if (mapped != nullptr) vkUnmapMemory(device, memory);
+        vkFreeMemory(device, memory, nullptr);
+
+        device_allocation_count--;
+    }
+
+    uint32_t find_or_create_pool(uint32_t memory_type, em_memory::ResourceKind kind)
+    {
+        for (uint32_t i = 0; i < pools.size(); i++)
+        {
+            if (pools[i].memory_type == memory_type && pools[i].kind == kind) return i;
+        }
+
+        // Don't let a single block take up a large part of small heaps (e.g. host visible VRAM).
+        VkDeviceSize heap_size = memory_properties.memoryHeaps[memory_properties.memoryTypes[memory_type].heapIndex].size;
+        VkDeviceSize block_size = preferred_block_size;
+        while (block_size > MIN_ALLOCATION_SIZE && block_size > heap_size / 8) block_size >>= 1;
+
+        Pool pool {};
+        pool.memory_type = memory_type;
+        pool.kind = kind;
+        pool.block_size = block_size;
+        pool.level_count = 1;
+        while ((block_size >> (pool.level_count - 1)) > MIN_ALLOCATION_SIZE) pool.level_count++;
+
+        pools.push_back(pool);
+        return static_cast<uint32_t>(pools.size() - 1);
+    }
+
+    size_t free_bit(const Pool& pool, uint32_t level, VkDeviceSize offset)
+    {
+        return (static_cast<size_t>(1) << level) - 1 + static_cast<size_t>(offset / level_size(pool, level));
+    }
+
+    bool is_free(const Pool& pool, const Block& block, uint32_t level, VkDeviceSize offset)
+    {
+        size_t bit = free_bit(pool, level, offset);
+        return (block.free_bits[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    void set_free(const Pool& pool, Block& block, uint32_t level, VkDeviceSize offset, bool free)
+    {
+        size_t bit = free_bit(pool, level, offset);
+        uint64_t mask = static_cast<uint64_t>(1) << (bit % 64);
+
+        if (free) block.free_bits[bit / 64] |= mask;
+        else block.free_bits[bit / 64] &= ~mask;
+
+        if (free) block.free_counts[level]++;
+        else block.free_counts[level]--;
+    }
+
+    // Lowest free offset on the level, which must have a free buddy.
+    VkDeviceSize first_free_offset(const Pool& pool, const Block& block, uint32_t level)
+    {
+        size_t first_bit = free_bit(pool, level, 0);
+        size_t bit = first_bit;
+
+        // The first set bit from the start of the level is on the level itself, it has one.
+        uint64_t word = block.free_bits[bit / 64] >> (bit % 64);
+        while (word == 0)
+        {
+            bit += 64 - bit % 64;
+            word = block.free_bits[bit / 64];
+        }
+
+        while ((word & 1) == 0)
+        {
+            word >>= 1;
+            bit++;
+        }
+
+        return (bit - first_bit) * level_size(pool, level);
+    }
+
+    bool allocate_from_block(Pool& pool, Block& block, uint32_t level, VkDeviceSize* offset)
+    {
+        // Find the smallest free buddy that is large enough.
+        int found_level = static_cast<int>(level);
+        while (found_level >= 0 && block.free_counts[found_level] == 0) found_level--;
+
+        if (found_level < 0) return false;
+
+        VkDeviceSize block_offset = first_free_offset(pool, block, found_level);
+        set_free(pool, block, found_level, block_offset, false);
+
+        // Split it until it has the requested size, the second halves are freed.
+        for (uint32_t split_level = found_level + 1; split_level <= level; split_level++)
+        {
+            set_free(pool, block, split_level, block_offset + level_size(pool, split_level), true);
+        }
+
+        *offset = block_offset;
+        return true;
+    }
+}
+
+void em_memory::init(VkPhysicalDevice physical_device_handle, VkDevice device_handle, VkDeviceSize block_size)
+{
+    physical_device = physical_device_handle;
+    device = device_handle;
+    preferred_block_size = round_up_to_power_of_two(block_size);
+
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(physical_device, &device_properties);
+    max_allocation_count = device_properties.limits.maxMemoryAllocationCount;
+}
+
+void em_memory::destroy()
+{
+    for (Pool& pool : pools)
+    {
+        for (Block& block : pool.blocks)
+        {
+            free_device_memory(block.memory, block.mapped);
+        }
+    }
+
+    pools.clear();
+}
+
+uint32_t em_memory::find_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties)
+{
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+    {
+        if ((type_filter & (1 << i)) && (memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
+        {
+            return i;
+        }
+    }
+
+    throw std::runtime_error("Failed to find a suitable memory type!");
+}
+
+em_memory::Allocation em_memory::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, ResourceKind kind)
+{
+    std::lock_guard<std::mutex> lock(arena_mutex);
+
+    uint32_t memory_type = find_memory_type(requirements.memoryTypeBits, properties);
+    uint32_t pool_index = find_or_create_pool(memory_type, kind);
+    Pool& pool = pools[pool_index];
+
+    Allocation allocation;
+    allocation.size = requirements.size;
+    allocation.pool_index = pool_index;
+
+    // Buddies are aligned to their own size, so rounding up to the alignment is enough to satisfy it.
+    VkDeviceSize buddy_size = round_up_to_power_of_two(std::max({requirements.size, requirements.alignment, MIN_ALLOCATION_SIZE}));
+
+    // Resources larger than a block get their own allocation.
+    if (buddy_size > pool.block_size)
+    {
+        allocation.memory = allocate_device_memory(requirements.size, memory_type, &allocation.mapped);
+        allocation.dedicated = true;
+
+        dedicated_allocation_count++;
+        dedicated_bytes += requirements.size;
+        return allocation;
+    }
+
+    uint32_t level = 0;
+    while (level_size(pool, level) > buddy_size) level++;
+    allocation.level = level;
+
+    bool found = false;
+    for (uint32_t i = 0; i < pool.blocks.size() && !found; i++)
+    {
+        if (allocate_from_block(pool, pool.blocks[i], level, &allocation.offset))
+        {
+            allocation.block_index = i;
+            found = true;
+        }
+    }
+
+    // No free space in any existing block
+    if (!found)
+    {
+        Block block {};
+        block.memory = allocate_device_memory(pool.block_size, memory_type, &block.mapped);
+        block.free_bits.resize(((static_cast<size_t>(1) << pool.level_count) + 63) / 64);
+        block.free_counts.resize(pool.level_count);
+        set_free(pool, block, 0, 0, true);
+
+        pool.blocks.push_back(std::move(block));
+        allocation.block_index = static_cast<uint32_t>(pool.blocks.size() - 1);
+
+        allocate_from_block(pool, pool.blocks.back(), level, &allocation.offset);
+    }
+
+    Block& block = pool.blocks[allocation.block_index];
+    block.allocated_bytes += level_size(pool, level);
+    block.requested_bytes += requirements.size;
+
+    allocation.memory = block.memory;
+    if (block.mapped != nullptr) allocation.mapped = static_cast<char*>(block.mapped) + allocation.offset;
+
+    return allocation;
+}
+
+void em_memory::free(const Allocation& allocation)
+{
+    if (allocation.memory == VK_NULL_HANDLE) return;
+
+    std::lock_guard<std::mutex> lock(arena_mutex);
+
+    if (allocation.dedicated)
+    {
+        free_device_memory(allocation.memory, allocation.mapped);
+
+        dedicated_allocation_count--;
+        dedicated_bytes -= allocation.size;
+        return;
+    }
+
+    Pool& pool = pools[allocation.pool_index];
+    Block& block = pool.blocks[allocation.block_index];
+
+    block.allocated_bytes -= level_size(pool, allocation.level);
+    block.requested_bytes -= allocation.size;
+
+    // Merge with the buddy for as long as it is free as well.
+    VkDeviceSize offset = allocation.offset;
+    uint32_t level = allocation.level;
+
+    while (level > 0)
+    {
+        VkDeviceSize buddy_offset = offset ^ level_size(pool, level);
+        if (!is_free(pool, block, level, buddy_offset)) break;
+
+        set_free(pool, block, level, buddy_offset, false);
+        offset = std::min(offset, buddy_offset);
+        level--;
+    }
+
+    set_free(pool, block, level, offset, true);
+}
+
+em_memory::Allocation em_memory::allocate_buffer(VkBuffer buffer, VkMemoryPropertyFlags properties)
+{
+    VkMemoryRequirements memory_requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &memory_requirements);
+
+    Allocation allocation = allocate(memory_requirements, properties, RESOURCE_LINEAR);
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+
+    return allocation;
+}
+
+em_memory::Allocation em_memory::allocate_image(VkImage image, VkMemoryPropertyFlags properties, VkImageTiling tiling)
+{
+    VkMemoryRequirements memory_requirements;
+    vkGetImageMemoryRequirements(device, image, &memory_requirements);
+
+    Allocation allocation = allocate(memory_requirements, properties, tiling == VK_IMAGE_TILING_OPTIMAL ? RESOURCE_OPTIMAL : RESOURCE_LINEAR);
+    vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+
+    return allocation;
+}
+
+em_memory::Allocation em_memory::allocate_transient_image(VkImage image, bool* lazily_allocated)
+{
+    VkMemoryRequirements memory_requirements;
+    vkGetImageMemoryRequirements(device, image, &memory_requirements);
+
+    VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+    {
+        if ((memory_requirements.memoryTypeBits & (1 << i)) && (memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT))
+        {
+            properties = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+            break;
+        }
+    }
+
+    if (lazily_allocated != nullptr) *lazily_allocated = properties == VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+
+    Allocation allocation = allocate(memory_requirements, properties, RESOURCE_OPTIMAL);
+    vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+
+    return allocation;
+}
+
+void em_memory::print_statistics(std::ostream& stream)
+{
+    std::lock_guard<std::mutex> lock(arena_mutex);
+
+    stream << "Device memory: " << device_allocation_count << " of " << max_allocation_count << " allocations used, "
+        << dedicated_allocation_count << " dedicated (" << dedicated_bytes << " bytes)" << std::endl;
+
+    for (const Pool& pool : pools)
+    {
+        VkDeviceSize reserved = 0, allocated = 0, requested = 0;
+        VkDeviceSize largest_free = 0; // Sum of the largest free range of every block
+
+        for (const Block& block : pool.blocks)
+        {
+            reserved += pool.block_size;
+            allocated += block.allocated_bytes;
+            requested += block.requested_bytes;
+
+            for (uint32_t level = 0; level < pool.level_count; level++)
+            {
+                if (block.free_counts[level] > 0)
+                {
+                    largest_free += level_size(pool, level);
+                    break;
+                }
+            }
+        }
+
+        VkDeviceSize free_bytes = reserved - allocated;
+
+        // Internal: space lost by rounding up to buddy sizes. External: free space outside of the largest free range of its block.
+        double internal_fragmentation = allocated > 0 ? 1.0 - static_cast<double>(requested) / allocated : 0.0;
+        double external_fragmentation = free_bytes > 0 ? 1.0 - static_cast<double>(largest_free) / free_bytes : 0.0;
+
+        stream << "  memory type " << pool.memory_type << (pool.kind == RESOURCE_LINEAR ? " (linear)" : " (optimal)")
+            << ": " << pool.blocks.size() << " blocks of " << pool.block_size << " bytes, "
+            << requested << " bytes in use, " << free_bytes << " bytes free, "
+            << "internal fragmentation " << internal_fragmentation * 100.0 << "%, "
+            << "external fragmentation " << external_fragmentation * 100.0 << "%" << std::endl;
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <ostream>
+
+// Device memory arena. Instead of calling vkAllocateMemory for every resource (which is slow and limited
+// by maxMemoryAllocationCount) large blocks are allocated per memory type and sub-allocated with a buddy
+// allocator. Linear (buffers) and optimal (images) resources never share a block, so bufferImageGranularity
+// is always respected. Host visible blocks are persistently mapped.
+namespace em_memory
+{
+    enum ResourceKind
+    {
+        RESOURCE_LINEAR,    // Buffers and linearly tiled images
+        RESOURCE_OPTIMAL    // Optimally tiled images
+    };
+
+    struct Allocation
+    {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        void* mapped = nullptr; // Only set for host visible memory
+
+        // Bookkeeping used to return the allocation to its block
+        uint32_t pool_index = 0;
+        uint32_t block_index = 0;
+        uint32_t level = 0;
+        bool dedicated = false;
+    };
+
+    void init(VkPhysicalDevice physical_device, VkDevice device, VkDeviceSize preferred_block_size = 64 * 1024 * 1024);
+    void destroy();
+
+    uint32_t find_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties);
+
+    Allocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, ResourceKind kind);
+    void free(const Allocation& allocation);
+
+    // Allocate memory for the resource and bind it.
+    Allocation allocate_buffer(VkBuffer buffer, VkMemoryPropertyFlags properties);
+    Allocation allocate_image(VkImage image, VkMemoryPropertyFlags properties, VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL);
+
+    // For attachments created with VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT. Uses lazily allocated memory when there is any
+    // (tile based GPUs then never back it), device local memory otherwise. lazily_allocated tells which one it got.
+    Allocation allocate_transient_image(VkImage image, bool* lazily_allocated = nullptr);
+
+    void print_statistics(std::ostream& stream);
+}
@@ -0,0 +1,581 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    struct FrameRecord
+    {
+        uint64_t frame_number;
+        double phase_ms[em_profiler::PHASE_COUNT]; // Negative if the phase didn't run (or has no result yet)
+        int64_t statistics[em_profiler::STATISTIC_COUNT]; // Negative if there are no results (yet)
+    };
+
+    struct PhaseSummary
+    {
+        size_t sample_count;
+        double mean, p50, p95, p99;
+    };
+
+    bool enabled = false;
+
+    // Ring buffer of the last history.size() frames, indexed by frame number.
+    std::vector<FrameRecord> history;
+    uint64_t frame_count = 0;
+
+    FrameRecord current_record;
+    std::chrono::steady_clock::time_point phase_start_times[em_profiler::PHASE_COUNT];
+
+    // Two timestamps (start and end of the render pass) per frame in flight.
+    VkQueryPool timestamp_query_pool = VK_NULL_HANDLE;
+    double timestamp_period_ns = 0.0;
+    uint64_t timestamp_mask = 0;
+
+    std::vector<std::pair<std::string, double>> metrics;
+
+    std::vector<uint64_t> slot_frame_numbers;
+    std::vector<bool> slot_pending;
+    uint32_t recording_slot = 0;
+
+    // One pipeline statistics query per frame in flight, counting everything in em_profiler::Statistic.
+    VkQueryPool statistics_query_pool = VK_NULL_HANDLE;
+    const VkQueryPipelineStatisticFlags STATISTICS_FLAGS =
+        VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+
+    std::vector<uint64_t> statistics_frame_numbers;
+    std::vector<bool> statistics_pending;
+    bool statistics_recording = false; // The frame being recorded has a statistics query
+    uint64_t statistic_totals[em_profiler::STATISTIC_COUNT] = {};
+    uint64_t statistics_frame_count = 0;
+    uint64_t statistics_skipped_frame_count = 0; // Not queried because the slot's previous result was still pending
+
+    double statistic_per_frame(em_profiler::Statistic statistic)
+    {
+        return statistics_frame_count > 0 ? static_cast<double>(statistic_totals[statistic]) / statistics_frame_count : 0.0;
+    }
+
+    PhaseSummary summarize(em_profiler::Phase phase)
+    {
+        std::vector<double> samples;
+        size_t stored = static_cast<size_t>(std::min<uint64_t>(frame_count, history.size()));
+
+        for (size_t i = 0; i < stored; i++)
+        {
+            if (history[i].phase_ms[phase] >= 0.0) samples.push_back(history[i].phase_ms[phase]);
+        }
+
+        PhaseSummary summary {};
+        summary.sample_count = samples.size();
+        if (samples.empty()) return summary;
+
+        std::sort(samples.begin(), samples.end());
+
+        // Nearest-rank percentile
+        auto percentile = [&samples](double p) {
+            size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+            return samples[std::max<size_t>(rank, 1) - 1];
+        };
+
+        double total = 0.0;
+        for (double sample : samples) total += sample;
+
+        summary.mean = total / samples.size();
+        summary.p50 = percentile(0.50);
+        summary.p95 = percentile(0.95);
+        summary.p99 = percentile(0.99);
+
+        return summary;
+    }
+
+    void write_csv(std::ofstream& file)
+    {
+        file << "frame";
+        for (int phase = 0; phase < em_profiler::PHASE_COUNT; phase++)
+        {
+            file << "," << em_profiler::phase_name(static_cast<em_profiler::Phase>(phase)) << "_ms";
+        }
+        for (int statistic = 0; statistic < em_profiler::STATISTIC_COUNT; statistic++)
+        {
+            file << "," << em_profiler::statistic_name(static_cast<em_profiler::Statistic>(statistic));
+        }
+        file << "\n";
+
+        uint64_t first_frame = frame_count > history.size() ? frame_count - history.size() : 0;
+        for (uint64_t frame = first_frame; frame < frame_count; frame++)
+        {
+            const FrameRecord& record = history[frame % history.size()];
+
+            file << record.frame_number;
+            for (int phase = 0; phase < em_profiler::PHASE_COUNT; phase++)
+            {
+                file << ",";
+                if (record.phase_ms[phase] >= 0.0) file << record.phase_ms[phase];
+            }
+            for (int statistic = 0; statistic < em_profiler::STATISTIC_COUNT; statistic++)
+            {
+                file << ",";
+                if (record.statistics[statistic] >= 0) file << record.statistics[statistic];
+            }
+            file << "\n";
+        }
+    }
+
+    void write_json(std::ofstream& file)
+    {
+        file << "{\n  \"frames\": " << frame_count << ",\n  \"phases\": {";
+
+        for (int phase = 0; phase < em_profiler::PHASE_COUNT; phase++)
+        {
+            PhaseSummary summary = summarize(static_cast<em_profiler::Phase>(phase));
+
+            file << (phase == 0 ? "\n" : ",\n")
+                << "    \"" << em_profiler::phase_name(static_cast<em_profiler::Phase>(phase)) << "\": {"
+                << "\"samples\": " << summary.sample_count
+                << ", \"mean_ms\": " << summary.mean
+                << ", \"p50_ms\": " << summary.p50
+                << ", \"p95_ms\": " << summary.p95
+                << ", \"p99_ms\": " << summary.p99 << "}";
+        }
+
+        file << "\n  },\n  \"metrics\": {";
+
+        for (size_t i = 0; i < metrics.size(); i++)
+        {
+            file << (i == 0 ? "\n" : ",\n") << "    \"" << metrics[i].first << "\": " << metrics[i].second;
+        }
+
+        // Means per frame
+        file << "\n  },\n  \"statistics\": {";
+
+        for (int statistic = 0; statistic < em_profiler::STATISTIC_COUNT && statistics_frame_count > 0; statistic++)
+        {
+            file << (statistic == 0 ? "\n" : ",\n") << "    \"" << em_profiler::statistic_name(static_cast<em_profiler::Statistic>(statistic))
+                << "\": " << statistic_per_frame(static_cast<em_profiler::Statistic>(statistic));
+        }
+
+        if (statistics_frame_count > 0) file << ",\n    \"skipped_frames\": " << statistics_skipped_frame_count;
+
+        file << "\n  }\n}\n";
+    }
+
+    // Prometheus text exposition format. Phases are summaries in milliseconds, statistics are counters with their
+    // mean per frame as a gauge next to them, and every metric is a gauge of its own.
+    void write_prometheus(std::ofstream& file)
+    {
+        file << "# HELP em_frame_phase_ms CPU and GPU time of the frame phases.\n# TYPE em_frame_phase_ms summary\n";
+
+        for (int phase = 0; phase < em_profiler::PHASE_COUNT; phase++)
+        {
+            PhaseSummary summary = summarize(static_cast<em_profiler::Phase>(phase));
+            if (summary.sample_count == 0) continue;
+
+            std::string label = std::string("phase=\"") + em_profiler::phase_name(static_cast<em_profiler::Phase>(phase)) + "\"";
+
+            file << "em_frame_phase_ms{" << label << ",quantile=\"0.5\"} " << summary.p50 << "\n"
+                << "em_frame_phase_ms{" << label << ",quantile=\"0.95\"} " << summary.p95 << "\n"
+                << "em_frame_phase_ms{" << label << ",quantile=\"0.99\"} " << summary.p99 << "\n"
+                << "em_frame_phase_ms_sum{" << label << "} " << summary.mean * summary.sample_count << "\n"
+                << "em_frame_phase_ms_count{" << label << "} " << summary.sample_count << "\n";
+        }
+
+        if (statistics_frame_count > 0)
+        {
+            file << "# HELP em_pipeline_statistic_total Pipeline statistics summed over all frames.\n# TYPE em_pipeline_statistic_total counter\n";
+            for (int statistic = 0; statistic < em_profiler::STATISTIC_COUNT; statistic++)
+            {
+                file << "em_pipeline_statistic_total{statistic=\"" << em_profiler::statistic_name(static_cast<em_profiler::Statistic>(statistic))
+                    << "\"} " << statistic_totals[statistic] << "\n";
+            }
+
+            file << "# HELP em_pipeline_statistic_per_frame Mean pipeline statistics per frame.\n# TYPE em_pipeline_statistic_per_frame gauge\n";
+            for (int statistic = 0; statistic < em_profiler::STATISTIC_COUNT; statistic++)
+            {
+                file << "em_pipeline_statistic_per_frame{statistic=\"" << em_profiler::statistic_name(static_cast<em_profiler::Statistic>(statistic))
+                    << "\"} " << statistic_per_frame(static_cast<em_profiler::Statistic>(statistic)) << "\n";
+            }
+
+            file << "# HELP em_pipeline_statistic_skipped_frames Frames without pipeline statistics, the previous result of their slot was still pending.\n"
+                << "# TYPE em_pipeline_statistic_skipped_frames counter\nem_pipeline_statistic_skipped_frames " << statistics_skipped_frame_count << "\n";
+        }
+
+        for (const std::pair<std::string, double>& metric : metrics)
+        {
+            file << "# TYPE em_" << metric.first << " gauge\nem_" << metric.first << " " << metric.second << "\n";
+        }
+    }
+
+    // One name,value row per value, with the same dotted names as the JSON results.
+    void write_metrics_csv(std::ofstream& file)
+    {
+        file << "name,value\n";
+
+        for (int phase = 0; phase < em_profiler::PHASE_COUNT; phase++)
+        {
+            PhaseSummary summary = summarize(static_cast<em_profiler::Phase>(phase));
+            if (summary.sample_count == 0) continue;
+
+            std::string prefix = std::string("phases.") + em_profiler::phase_name(static_cast<em_profiler::Phase>(phase));
+
+            file << prefix << ".mean_ms," << summary.mean << "\n"
+                << prefix << ".p50_ms," << summary.p50 << "\n"
+                << prefix << ".p95_ms," << summary.p95 << "\n"
+                << prefix << ".p99_ms," << summary.p99 << "\n";
+        }
+
+        for (int statistic = 0; statistic < em_profiler::STATISTIC_COUNT && statistics_frame_count > 0; statistic++)
+        {
+            file << "statistics." << em_profiler::statistic_name(static_cast<em_profiler::Statistic>(statistic)) << ","
+                << statistic_per_frame(static_cast<em_profiler::Statistic>(statistic)) << "\n";
+        }
+
+        if (statistics_frame_count > 0) file << "statistics.skipped_frames," << statistics_skipped_frame_count << "\n";
+
+        for (const std::pair<std::string, double>& metric : metrics)
+        {
+            file << "metrics." << metric.first << "," << metric.second << "\n";
+        }
+    }
+}
+
+const char* em_profiler::phase_name(Phase phase)
+{
+    switch (phase)
+    {
+        case PHASE_WAIT_FENCE: return "wait_fence";
+        case PHASE_ACQUIRE: return "acquire";
+        case PHASE_RECORD: return "record";
+        case PHASE_SUBMIT: return "submit";
+        case PHASE_PRESENT: return "present";
+        case PHASE_FRAME: return "frame";
+        case PHASE_GPU: return "gpu";
+        default: return "unknown";
+    }
+}
+
+const char* em_profiler::statistic_name(Statistic statistic)
+{
+    switch (statistic)
+    {
+        case STATISTIC_INPUT_ASSEMBLY_VERTICES: return "input_assembly_vertices";
+        case STATISTIC_INPUT_ASSEMBLY_PRIMITIVES: return "input_assembly_primitives";
+        case STATISTIC_VERTEX_SHADER_INVOCATIONS: return "vertex_shader_invocations";
+        case STATISTIC_CLIPPING_INVOCATIONS: return "clipping_invocations";
+        case STATISTIC_CLIPPING_PRIMITIVES: return "clipping_primitives";
+        case STATISTIC_FRAGMENT_SHADER_INVOCATIONS: return "fragment_shader_invocations";
+        case STATISTIC_COMPUTE_SHADER_INVOCATIONS: return "compute_shader_invocations";
+        default: return "unknown";
+    }
+}
+
+void em_profiler::enable(size_t history_size)
+{
+    enabled = true;
+
+    // Allocated up front so recording a frame never allocates.
+    history.resize(history_size);
+}
+
+bool em_profiler::is_enabled()
+{
+    return enabled;
+}
+
+void em_profiler::init(VkPhysicalDevice physical_device, VkDevice device, uint32_t queue_family_index, uint32_t frames_in_flight,
+    bool pipeline_statistics)
+{
+    if (!enabled) return;
+
+    slot_frame_numbers.assign(frames_in_flight, 0);
+    slot_pending.assign(frames_in_flight, false);
+    statistics_frame_numbers.assign(frames_in_flight, 0);
+    statistics_pending.assign(frames_in_flight, false);
+
+    if (pipeline_statistics)
+    {
+        VkQueryPoolCreateInfo statistics_pool_info {};
+        statistics_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        statistics_pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        statistics_pool_info.queryCount = frames_in_flight;
+        statistics_pool_info.pipelineStatistics = STATISTICS_FLAGS;
+
+        if (vkCreateQueryPool(device, &statistics_pool_info, nullptr, &statistics_query_pool) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline statistics query pool!");
+        }
+    }
+    else
+    {
+        std::cout << "Pipeline statistics queries are not available, pipeline statistics disabled." << std::endl;
+    }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(physical_device, &device_properties);
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, nullptr);
+
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, queue_families.data());
+
+    uint32_t valid_bits = queue_families[queue_family_index].timestampValidBits;
+
+    // GPU timings are optional, CPU timings still work without them.
+    if (valid_bits == 0 || device_properties.limits.timestampPeriod == 0.0f)
+    {
+        std::cout << "Timestamp queries are not supported on this queue, GPU timings disabled." << std::endl;
+        return;
+    }
+
+    timestamp_period_ns = device_properties.limits.timestampPeriod;
+    timestamp_mask = valid_bits >= 64 ? UINT64_MAX : (uint64_t(1) << valid_bits) - 1;
+
+    VkQueryPoolCreateInfo query_pool_info {};
+    query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    query_pool_info.queryCount = frames_in_flight * 2;
+
+    if (vkCreateQueryPool(device, &query_pool_info, nullptr, &timestamp_query_pool) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create timestamp query pool!");
+    }
+}
+
+void em_profiler::destroy(VkDevice device)
+{
+    if (statistics_query_pool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(device, statistics_query_pool, nullptr);
+        statistics_query_pool = VK_NULL_HANDLE;
+    }
+
+    if (timestamp_query_pool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(device, timestamp_query_pool, nullptr);
+        timestamp_query_pool = VK_NULL_HANDLE;
+    }
+}
+
+void em_profiler::begin_frame()
+{
+    if (!enabled) return;
+
+    current_record.frame_number = frame_count;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) current_record.phase_ms[phase] = -1.0;
+    for (int statistic = 0; statistic < STATISTIC_COUNT; statistic++) current_record.statistics[statistic] = -1;
+
+    begin_phase(PHASE_FRAME);
+}
+
+void em_profiler::end_frame()
+{
+    if (!enabled) return;
+
+    end_phase(PHASE_FRAME);
+
+    history[frame_count % history.size()] = current_record;
+    frame_count++;
+}
+
+void em_profiler::begin_phase(Phase phase)
+{
+    if (!enabled) return;
+
+    phase_start_times[phase] = std::chrono::steady_clock::now();
+}
+
+void em_profiler::end_phase(Phase phase)
+{
+    if (!enabled) return;
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - phase_start_times[phase];
+    current_record.phase_ms[phase] = elapsed.count();
+}
+
+void em_profiler::cmd_begin_gpu_timer(VkCommandBuffer command_buffer, uint32_t frame)
+{
+    if (!enabled) return;
+
+    recording_slot = frame;
+
+    if (statistics_query_pool != VK_NULL_HANDLE)
+    {
+        // Resetting the query would throw away the previous result of the slot, which wasn't available yet.
+        // That one is still read later, this frame is counted as skipped instead.
+        statistics_recording = !statistics_pending[frame];
+
+        if (statistics_recording)
+        {
+            statistics_frame_numbers[frame] = frame_count;
+            statistics_pending[frame] = true;
+
+            vkCmdResetQueryPool(command_buffer, statistics_query_pool, frame, 1);
+            vkCmdBeginQuery(command_buffer, statistics_query_pool, frame, 0);
+        }
+        else
+        {
+            statistics_skipped_frame_count++;
+        }
+    }
+
+    if (timestamp_query_pool == VK_NULL_HANDLE) return;
+
+    slot_frame_numbers[frame] = frame_count;
+    slot_pending[frame] = true;
+
+    vkCmdResetQueryPool(command_buffer, timestamp_query_pool, frame * 2, 2);
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_query_pool, frame * 2);
+}
+
+void em_profiler::cmd_end_gpu_timer(VkCommandBuffer command_buffer)
+{
+    if (!enabled) return;
+
+    if (statistics_query_pool != VK_NULL_HANDLE && statistics_recording) vkCmdEndQuery(command_buffer, statistics_query_pool, recording_slot);
+    if (timestamp_query_pool == VK_NULL_HANDLE) return;
+
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_query_pool, recording_slot * 2 + 1);
+}
+
+VkQueryPipelineStatisticFlags em_profiler::pipeline_statistics_flags()
+{
+    return statistics_query_pool != VK_NULL_HANDLE ? STATISTICS_FLAGS : 0;
+}
+
+void em_profiler::collect_gpu_timings(VkDevice device, uint32_t frame)
+{
+    if (!enabled) return;
+
+    // Never waits: if the results aren't available yet, they're read the next time the slot comes around.
+    if (statistics_query_pool != VK_NULL_HANDLE && statistics_pending[frame])
+    {
+        // Every statistic followed by the availability
+        uint64_t statistics[STATISTIC_COUNT + 1];
+        VkResult result = vkGetQueryPoolResults(device, statistics_query_pool, frame, 1, sizeof(statistics), statistics,
+            sizeof(statistics), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+
+        if (result == VK_SUCCESS && statistics[STATISTIC_COUNT] != 0)
+        {
+            statistics_pending[frame] = false;
+            statistics_frame_count++;
+
+            uint64_t frame_number = statistics_frame_numbers[frame];
+            FrameRecord& record = history[frame_number % history.size()];
+
+            for (int statistic = 0; statistic < STATISTIC_COUNT; statistic++)
+            {
+                statistic_totals[statistic] += statistics[statistic];
+                if (record.frame_number == frame_number) record.statistics[statistic] = static_cast<int64_t>(statistics[statistic]);
+            }
+        }
+    }
+
+    if (timestamp_query_pool == VK_NULL_HANDLE || !slot_pending[frame]) return;
+
+    // Timestamp followed by its availability value, for both queries.
+    uint64_t results[4];
+    VkResult result = vkGetQueryPoolResults(device, timestamp_query_pool, frame * 2, 2, sizeof(results), results,
+        sizeof(uint64_t) * 2, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+
+    if (result != VK_SUCCESS || results[1] == 0 || results[3] == 0) return;
+
+    slot_pending[frame] = false;
+
+    uint64_t frame_number = slot_frame_numbers[frame];
+    FrameRecord& record = history[frame_number % history.size()];
+
+    // The frame might already have been pushed out of the ring buffer.
+    if (record.frame_number != frame_number) return;
+
+    uint64_t ticks = ((results[2] & timestamp_mask) - (results[0] & timestamp_mask)) & timestamp_mask;
+    record.phase_ms[PHASE_GPU] = ticks * timestamp_period_ns / 1000000.0;
+}
+
+void em_profiler::record_metric(const std::string& name, double value)
+{
+    if (!enabled) return;
+
+    for (std::pair<std::string, double>& metric : metrics)
+    {
+        if (metric.first == name)
+        {
+            metric.second = value;
+            return;
+        }
+    }
+
+    metrics.emplace_back(name, value);
+}
+
+void em_profiler::print_summary(std::ostream& stream)
+{
+    if (!enabled) return;
+
+    stream << "Frame timings over the last " << std::min<uint64_t>(frame_count, history.size()) << " frames (ms):" << std::endl;
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        PhaseSummary summary = summarize(static_cast<Phase>(phase));
+        if (summary.sample_count == 0) continue;
+
+        stream << "  " << phase_name(static_cast<Phase>(phase))
+            << ": mean " << summary.mean
+            << ", p50 " << summary.p50
+            << ", p95 " << summary.p95
+            << ", p99 " << summary.p99 << std::endl;
+    }
+
+    for (const std::pair<std::string, double>& metric : metrics)
+    {
+        stream << "  " << metric.first << ": " << metric.second << std::endl;
+    }
+
+    if (statistics_frame_count > 0)
+    {
+        stream << "Pipeline statistics per frame (mean over " << statistics_frame_count << " frames, "
+            << statistics_skipped_frame_count << " skipped while a result was pending):" << std::endl;
+
+        for (int statistic = 0; statistic < STATISTIC_COUNT; statistic++)
+        {
+            stream << "  " << statistic_name(static_cast<Statistic>(statistic)) << ": " << statistic_per_frame(static_cast<Statistic>(statistic)) << std::endl;
+        }
+    }
+}
+
+void em_profiler::write_results(const std::string& filename)
+{
+    if (!enabled) return;
+
+    std::ofstream file(filename, std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Failed to open file " + filename);
+
+    bool json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+
+    if (json) write_json(file);
+    else write_csv(file);
+}
+
+void em_profiler::write_metrics(const std::string& filename)
+{
+    if (!enabled) return;
+
+    std::ofstream file(filename, std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Failed to open file " + filename);
+
+    bool prometheus = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".prom") == 0;
+
+    if (prometheus) write_prometheus(file);
+    else write_metrics_csv(file);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Frame timing instrumentation. CPU phases are measured with a steady clock, the GPU time of the
+// render pass is measured with timestamp queries (one pair per frame in flight). Every frame is
+// stored in a fixed size ring buffer which is summarized (p50/p95/p99) when the program exits.
+// Optionally the pipeline statistics of every frame (vertex, primitive and shader invocation counts) are collected with
+// a pipeline statistics query, to catch shader and geometry regressions.
+namespace em_profiler
+{
+    enum Phase
+    {
+        PHASE_WAIT_FENCE,
+        PHASE_ACQUIRE,
+        PHASE_RECORD,
+        PHASE_SUBMIT,
+        PHASE_PRESENT,
+        PHASE_FRAME,
+        PHASE_GPU,
+        PHASE_COUNT
+    };
+
+    const char* phase_name(Phase phase);
+
+    // In the order of their VkQueryPipelineStatisticFlagBits, which is the order the query returns them in.
+    enum Statistic
+    {
+        STATISTIC_INPUT_ASSEMBLY_VERTICES,
+        STATISTIC_INPUT_ASSEMBLY_PRIMITIVES,
+        STATISTIC_VERTEX_SHADER_INVOCATIONS,
+        STATISTIC_CLIPPING_INVOCATIONS,
+        STATISTIC_CLIPPING_PRIMITIVES,
+        STATISTIC_FRAGMENT_SHADER_INVOCATIONS,
+        STATISTIC_COMPUTE_SHADER_INVOCATIONS, // GPU culling
+        STATISTIC_COUNT
+    };
+
+    const char* statistic_name(Statistic statistic);
+
+    // Does nothing (and all other functions become no-ops) unless enable() was called first.
+    void enable(size_t history_size = 4096);
+    bool is_enabled();
+
+    // pipeline_statistics requires the pipelineStatisticsQuery feature.
+    void init(VkPhysicalDevice physical_device, VkDevice device, uint32_t queue_family_index, uint32_t frames_in_flight,
+        bool pipeline_statistics = false);
+    void destroy(VkDevice device);
+
+    void begin_frame();
+    void end_frame();
+
+    void begin_phase(Phase phase);
+    void end_phase(Phase phase);
+
+    // Must be recorded outside of a render pass.
+    void cmd_begin_gpu_timer(VkCommandBuffer command_buffer, uint32_t frame);
+    void cmd_end_gpu_timer(VkCommandBuffer command_buffer);
+
+    // Statistics counted between the GPU timer commands, 0 if none are. Secondary command buffers executed in
+    // between have to inherit them (which requires the inheritedQueries feature).
+    VkQueryPipelineStatisticFlags pipeline_statistics_flags();
+
+    // Reads back the GPU timestamps and statistics of the previous submission in this frame slot. Only call this
+    // after the previous frame of the slot finished, the results are then available without stalling.
+    void collect_gpu_timings(VkDevice device, uint32_t frame);
+
+    // One-off measurements (startup time, pipeline creation, ...), written next to the frame timings. Main thread only.
+    void record_metric(const std::string& name, double value);
+
+    void print_summary(std::ostream& stream);
+
+    // The format is picked from the file extension (.json, anything else is written as CSV).
+    void write_results(const std::string& filename);
+
+    // Summaries, statistics and metrics for dashboards, in the Prometheus text format (.prom) or as name,value CSV rows.
+    void write_metrics(const std::string& filename);
+}
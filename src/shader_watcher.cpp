@@ -0,0 +1,85 @@
+#include "shader_watcher.hpp"
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+    int inotify_fd = -1;
+
+    bool has_extension(const char* name, const char* extension)
+    {
+        size_t length = strlen(name);
+        size_t extension_length = strlen(extension);
+        return length > extension_length && strcmp(name + length - extension_length, extension) == 0;
+    }
+
+    bool is_glsl_file(const char* name)
+    {
+        return has_extension(name, ".vert") || has_extension(name, ".frag") || has_extension(name, ".comp") || has_extension(name, ".glsl");
+    }
+}
+
+bool em_shader_watcher::start(const std::vector<std::string>& directories)
+{
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) return false;
+
+    for (const std::string& directory : directories)
+    {
+        // Compilers and editors either write the file in place or move a temporary file over it.
+        if (inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            stop();
+            return false;
+        }
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void em_shader_watcher::stop()
+{
+#ifdef __linux__
+    if (inotify_fd >= 0) close(inotify_fd);
+    inotify_fd = -1;
+#endif
+}
+
+em_shader_watcher::Changes em_shader_watcher::poll_changes()
+{
+    Changes changes {};
+
+#ifdef __linux__
+    if (inotify_fd < 0) return changes;
+
+    alignas(inotify_event) char buffer[4096];
+
+    // Drain all pending events, read fails with EAGAIN once there are none left.
+    while (true)
+    {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) break;
+
+        for (char* pointer = buffer; pointer < buffer + length; )
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(pointer);
+            if (event->len > 0 && is_glsl_file(event->name)) changes.sources = true;
+            if (event->len > 0 && has_extension(event->name, ".spv")) changes.spirv = true;
+
+            pointer += sizeof(inotify_event) + event->len;
+        }
+    }
+#endif
+
+    return changes;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Watches directories for changed GLSL sources and SPIR-V files (inotify, so only supported on Linux).
+namespace em_shader_watcher
+{
+    struct Changes
+    {
+        bool sources; // .vert, .frag, .comp or .glsl
+        bool spirv;
+    };
+
+    // Returns false if watching isn't supported or one of the directories can't be watched.
+    bool start(const std::vector<std::string>& directories);
+    void stop();
+
+    // Non-blocking, reports which kinds of shader files in the directories were written since the last call.
+    Changes poll_changes();
+}
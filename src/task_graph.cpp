@@ -0,0 +1,181 @@
+#include "task_graph.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    struct Task
+    {
+        std::string name;
+        std::function<void()> function;
+        em_task_graph::TaskThread thread;
+
+        std::vector<em_task_graph::TaskId> dependents;
+        uint32_t remaining_dependencies;
+
+        // Timeline of the last run
+        double start_ms;
+        double end_ms;
+        int thread_index; // -1 for the main thread
+    };
+
+    std::vector<Task> tasks;
+    std::vector<Task> finished_tasks; // Tasks of the last run, kept for the timeline
+
+    std::mutex graph_mutex;
+    std::condition_variable graph_changed;
+
+    // Ordered by id, so a serial run executes the tasks in the order they were added.
+    std::set<em_task_graph::TaskId> ready_tasks;
+    std::set<em_task_graph::TaskId> ready_main_thread_tasks;
+    size_t unfinished_count = 0;
+    bool serial_run = false;
+
+    std::exception_ptr task_error;
+    std::chrono::steady_clock::time_point run_start_time;
+
+    double elapsed_ms()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - run_start_time).count();
+    }
+
+    // Called with the lock held.
+    void make_ready(em_task_graph::TaskId id)
+    {
+        if (tasks[id].thread == em_task_graph::MAIN_THREAD && !serial_run) ready_main_thread_tasks.insert(id);
+        else ready_tasks.insert(id);
+    }
+
+    // Called with the lock held, returns false once there is nothing left to run.
+    bool wait_for_task(std::unique_lock<std::mutex>& lock, bool main_thread, em_task_graph::TaskId* id)
+    {
+        auto has_task = [&] {
+            return !ready_tasks.empty() || (main_thread && !ready_main_thread_tasks.empty());
+        };
+
+        graph_changed.wait(lock, [&] { return has_task() || unfinished_count == 0 || task_error; });
+        if (task_error || !has_task()) return false;
+
+        // The main thread prefers the tasks only it can run.
+        std::set<em_task_graph::TaskId>& ready = main_thread && !ready_main_thread_tasks.empty() ? ready_main_thread_tasks : ready_tasks;
+
+        *id = *ready.begin();
+        ready.erase(ready.begin());
+        return true;
+    }
+
+    void run_tasks(int thread_index)
+    {
+        std::unique_lock<std::mutex> lock(graph_mutex);
+
+        em_task_graph::TaskId id;
+        while (wait_for_task(lock, thread_index < 0, &id))
+        {
+            tasks[id].start_ms = elapsed_ms();
+            tasks[id].thread_index = thread_index;
+
+            lock.unlock();
+
+            std::exception_ptr error;
+            try
+            {
+                tasks[id].function();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+
+            tasks[id].end_ms = elapsed_ms();
+            unfinished_count--;
+
+            if (error && !task_error) task_error = error;
+
+            for (em_task_graph::TaskId dependent : tasks[id].dependents)
+            {
+                if (--tasks[dependent].remaining_dependencies == 0) make_ready(dependent);
+            }
+
+            graph_changed.notify_all();
+        }
+    }
+}
+
+em_task_graph::TaskId em_task_graph::add(const std::string& name, std::function<void()> task, const std::vector<TaskId>& dependencies, TaskThread thread)
+{
+    TaskId id = static_cast<TaskId>(tasks.size());
+
+    Task new_task {};
+    new_task.name = name;
+    new_task.function = std::move(task);
+    new_task.thread = thread;
+    new_task.remaining_dependencies = static_cast<uint32_t>(dependencies.size());
+    new_task.thread_index = -1;
+
+    for (TaskId dependency : dependencies)
+    {
+        if (dependency >= id) throw std::runtime_error("Task " + name + " depends on a task that was added after it!");
+        tasks[dependency].dependents.push_back(id);
+    }
+
+    tasks.push_back(std::move(new_task));
+    return id;
+}
+
+void em_task_graph::run(uint32_t worker_count)
+{
+    run_start_time = std::chrono::steady_clock::now();
+    unfinished_count = tasks.size();
+    serial_run = worker_count == 0;
+    task_error = nullptr;
+
+    for (TaskId id = 0; id < tasks.size(); id++)
+    {
+        if (tasks[id].remaining_dependencies == 0) make_ready(id);
+    }
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < worker_count; i++)
+    {
+        workers.emplace_back(run_tasks, static_cast<int>(i));
+    }
+
+    run_tasks(-1);
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    finished_tasks = std::move(tasks);
+    tasks.clear();
+    ready_tasks.clear();
+    ready_main_thread_tasks.clear();
+
+    if (task_error)
+    {
+        std::exception_ptr error = task_error;
+        task_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void em_task_graph::print_timeline(std::ostream& stream)
+{
+    for (const Task& task : finished_tasks)
+    {
+        // Skipped after an error
+        if (task.end_ms == 0.0) continue;
+
+        stream << "  " << task.name << ": " << task.start_ms << " - " << task.end_ms << " ms ("
+            << (task.thread_index < 0 ? std::string("main thread") : "worker " + std::to_string(task.thread_index)) << ")" << std::endl;
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Runs work as a graph of tasks, every task starts as soon as its dependencies finished. Tasks run on worker threads
+// started for the run, tasks that have to run on the main thread (e.g. creating the window) run on the calling thread.
+namespace em_task_graph
+{
+    typedef uint32_t TaskId;
+
+    enum TaskThread
+    {
+        ANY_THREAD,
+        MAIN_THREAD
+    };
+
+    // Dependencies have to be added before the tasks depending on them.
+    TaskId add(const std::string& name, std::function<void()> task, const std::vector<TaskId>& dependencies = {}, TaskThread thread = ANY_THREAD);
+
+    // Runs all added tasks and clears the graph. With 0 workers everything runs on the calling thread, in the order it was
+    // added. The first exception thrown by a task is rethrown once the running tasks finished, the rest is skipped.
+    void run(uint32_t worker_count);
+
+    // When every task of the last run started and finished, relative to the start of the run.
+    void print_timeline(std::ostream& stream);
+}
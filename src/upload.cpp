@@ -0,0 +1,342 @@
+#include "upload.hpp"
+
+#include "memory.hpp"
+
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    struct StagingBuffer
+    {
+        VkBuffer buffer;
+        em_memory::Allocation memory;
+    };
+
+    // Uploads submitted together, signaling one timeline value.
+    struct Batch
+    {
+        uint64_t value = 0;
+        VkCommandBuffer transfer_command_buffer = VK_NULL_HANDLE;
+        std::vector<StagingBuffer> staging_buffers;
+
+        // Ownership acquires, recorded on the graphics queue once the batch is flushed.
+        std::vector<VkBufferMemoryBarrier> buffer_barriers;
+        VkPipelineStageFlags dst_stages = 0;
+
+        VkCommandBuffer acquire_command_buffer = VK_NULL_HANDLE;
+        uint64_t acquire_frame_value = 0; // Frame that is submitted right after the acquire, 0 until submitted
+    };
+
+    VkDevice device;
+    uint32_t transfer_family;
+    uint32_t graphics_family;
+    VkQueue transfer_queue;
+    VkQueue graphics_queue;
+
+    VkCommandPool transfer_command_pool = VK_NULL_HANDLE;
+    VkCommandPool graphics_command_pool = VK_NULL_HANDLE;
+
+    VkSemaphore timeline = VK_NULL_HANDLE;
+    uint64_t last_flushed_value = 0;
+
+    Batch recording_batch;
+    std::deque<Batch> flushed_batches; // In submission order
+
+    bool ownership_transfer()
+    {
+        return transfer_family != graphics_family;
+    }
+
+    VkCommandBuffer allocate_command_buffer(VkCommandPool command_pool)
+    {
+        VkCommandBufferAllocateInfo alloc_info {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandPool = command_pool;
+        alloc_info.commandBufferCount = 1;
+
+        VkCommandBuffer command_buffer;
+        if (vkAllocateCommandBuffers(device, &alloc_info, &command_buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate upload command buffer!");
+        }
+
+        VkCommandBufferBeginInfo begin_info {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(command_buffer, &begin_info);
+
+        return command_buffer;
+    }
+
+    // Returns the command buffer of the batch that is being recorded.
+    VkCommandBuffer recording_command_buffer()
+    {
+        if (recording_batch.transfer_command_buffer == VK_NULL_HANDLE)
+        {
+            recording_batch.transfer_command_buffer = allocate_command_buffer(transfer_command_pool);
+        }
+
+        return recording_batch.transfer_command_buffer;
+    }
+
+    StagingBuffer create_staging_buffer(const void* data, VkDeviceSize size)
+    {
+        StagingBuffer staging_buffer;
+
+        VkBufferCreateInfo buffer_info {};
+        buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        buffer_info.size = size;
+        buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        if (vkCreateBuffer(device, &buffer_info, nullptr, &staging_buffer.buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create staging buffer!");
+        }
+
+        staging_buffer.memory = em_memory::allocate_buffer(staging_buffer.buffer,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+        // Host visible memory is persistently mapped by the arena.
+        memcpy(staging_buffer.memory.mapped, data, static_cast<size_t>(size));
+
+        recording_batch.staging_buffers.push_back(staging_buffer);
+        return staging_buffer;
+    }
+
+    void release_batch(Batch& batch)
+    {
+        for (StagingBuffer& staging_buffer : batch.staging_buffers)
+        {
+            vkDestroyBuffer(device, staging_buffer.buffer, nullptr);
+            em_memory::free(staging_buffer.memory);
+        }
+
+        vkFreeCommandBuffers(device, transfer_command_pool, 1, &batch.transfer_command_buffer);
+
+        if (batch.acquire_command_buffer != VK_NULL_HANDLE)
+        {
+            vkFreeCommandBuffers(device, graphics_command_pool, 1, &batch.acquire_command_buffer);
+        }
+    }
+}
+
+void em_upload::init(VkDevice device_handle, uint32_t transfer_queue_family, VkQueue transfer_queue_handle,
+    uint32_t graphics_queue_family, VkQueue graphics_queue_handle)
+{
+    device = device_handle;
+    transfer_family = transfer_queue_family;
+    graphics_family = graphics_queue_family;
+    transfer_queue = transfer_queue_handle;
+    graphics_queue = graphics_queue_handle;
+
+    VkCommandPoolCreateInfo pool_info {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = transfer_family;
+
+    if (vkCreateCommandPool(device, &pool_info, nullptr, &transfer_command_pool) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create transfer command pool!");
+    }
+
+    pool_info.queueFamilyIndex = graphics_family;
+    if (ownership_transfer() && vkCreateCommandPool(device, &pool_info, nullptr, &graphics_command_pool) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create upload command pool!");
+    }
+
+    VkSemaphoreTypeCreateInfo semaphore_type_info {};
+    semaphore_type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    semaphore_type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    semaphore_type_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphore_info {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &semaphore_type_info;
+
+    if (vkCreateSemaphore(device, &semaphore_info, nullptr, &timeline) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create upload timeline semaphore!");
+    }
+}
+
+void em_upload::destroy()
+{
+    if (timeline == VK_NULL_HANDLE) return;
+
+    // Anything still queued is dropped.
+    if (recording_batch.transfer_command_buffer != VK_NULL_HANDLE) release_batch(recording_batch);
+    recording_batch = Batch();
+
+    for (Batch& batch : flushed_batches) release_batch(batch);
+    flushed_batches.clear();
+
+    vkDestroySemaphore(device, timeline, nullptr);
+    vkDestroyCommandPool(device, transfer_command_pool, nullptr);
+    if (graphics_command_pool != VK_NULL_HANDLE) vkDestroyCommandPool(device, graphics_command_pool, nullptr);
+
+    timeline = VK_NULL_HANDLE;
+    graphics_command_pool = VK_NULL_HANDLE;
+}
+
+void em_upload::upload_buffer(VkBuffer buffer, VkDeviceSize offset, const void* data, VkDeviceSize size,
+    VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+    StagingBuffer staging_buffer = create_staging_buffer(data, size);
+    VkCommandBuffer command_buffer = recording_command_buffer();
+
+    VkBufferCopy copy_region {};
+    copy_region.dstOffset = offset;
+    copy_region.size = size;
+    vkCmdCopyBuffer(command_buffer, staging_buffer.buffer, buffer, 1, &copy_region);
+
+    VkBufferMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+
+    if (ownership_transfer())
+    {
+        // Release, the destination scope is ignored and left to the acquire on the graphics queue.
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.srcQueueFamilyIndex = transfer_family;
+        barrier.dstQueueFamilyIndex = graphics_family;
+
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+            0, nullptr, 1, &barrier, 0, nullptr);
+
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = dst_access;
+        recording_batch.buffer_barriers.push_back(barrier);
+    }
+
+    // Without an ownership transfer the semaphore wait alone makes the copy visible.
+    recording_batch.dst_stages |= dst_stage;
+}
+
+uint64_t em_upload::flush()
+{
+    if (recording_batch.transfer_command_buffer == VK_NULL_HANDLE) return last_flushed_value;
+
+    if (vkEndCommandBuffer(recording_batch.transfer_command_buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to record upload command buffer!");
+    }
+
+    uint64_t signal_value = last_flushed_value + 1;
+
+    VkTimelineSemaphoreSubmitInfo timeline_info {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &signal_value;
+
+    VkSubmitInfo submit_info {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &recording_batch.transfer_command_buffer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &timeline;
+
+    if (vkQueueSubmit(transfer_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to submit uploads!");
+    }
+
+    last_flushed_value = signal_value;
+    recording_batch.value = signal_value;
+
+    flushed_batches.push_back(std::move(recording_batch));
+    recording_batch = Batch();
+
+    return signal_value;
+}
+
+void em_upload::submit_acquires(uint64_t frame_value)
+{
+    for (Batch& batch : flushed_batches)
+    {
+        if (batch.acquire_frame_value != 0) continue;
+
+        // The frame signals its timeline value after everything submitted before it, including the acquire.
+        batch.acquire_frame_value = frame_value;
+
+        VkTimelineSemaphoreSubmitInfo timeline_info {};
+        timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timeline_info.waitSemaphoreValueCount = 1;
+        timeline_info.pWaitSemaphoreValues = &batch.value;
+
+        // The semaphore wait orders all later work on the graphics queue after the copies.
+        VkSubmitInfo submit_info {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.pNext = &timeline_info;
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &timeline;
+        submit_info.pWaitDstStageMask = &batch.dst_stages;
+
+        if (ownership_transfer())
+        {
+            batch.acquire_command_buffer = allocate_command_buffer(graphics_command_pool);
+
+            // Chained to the semaphore wait through the source stages.
+            vkCmdPipelineBarrier(batch.acquire_command_buffer, batch.dst_stages, batch.dst_stages, 0, 0, nullptr,
+                static_cast<uint32_t>(batch.buffer_barriers.size()), batch.buffer_barriers.data(), 0, nullptr);
+
+            if (vkEndCommandBuffer(batch.acquire_command_buffer) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to record upload acquire command buffer!");
+            }
+
+            submit_info.commandBufferCount = 1;
+            submit_info.pCommandBuffers = &batch.acquire_command_buffer;
+        }
+
+        if (vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to submit upload acquires!");
+        }
+    }
+}
+
+void em_upload::collect(uint64_t completed_frame_value)
+{
+    while (!flushed_batches.empty())
+    {
+        Batch& batch = flushed_batches.front();
+
+        if (batch.acquire_frame_value == 0 || batch.acquire_frame_value > completed_frame_value) break;
+
+        release_batch(batch);
+        flushed_batches.pop_front();
+    }
+}
+
+bool em_upload::is_complete(uint64_t value)
+{
+    uint64_t completed_value = 0;
+    vkGetSemaphoreCounterValue(device, timeline, &completed_value);
+
+    return completed_value >= value;
+}
+
+void em_upload::wait(uint64_t value)
+{
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &timeline;
+    wait_info.pValues = &value;
+
+    vkWaitSemaphores(device, &wait_info, UINT64_MAX);
+}
+
+VkSemaphore em_upload::timeline_semaphore()
+{
+    return timeline;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+
+// Streams buffer data to the GPU on a (preferably dedicated) transfer queue, so uploads run
+// next to rendering instead of stalling it. Finished copies are tracked with a timeline semaphore. When the
+// transfer queue belongs to a different family, the buffers are released on the transfer queue and
+// acquired on the graphics queue with queue family ownership transfer barriers.
+namespace em_upload
+{
+    // Requires timeline semaphores (Vulkan 1.2). The memory arena has to be initialized first.
+    void init(VkDevice device, uint32_t transfer_queue_family, VkQueue transfer_queue, uint32_t graphics_queue_family, VkQueue graphics_queue);
+    void destroy();
+
+    // The data is copied into a staging buffer right away, the copy itself is recorded for the next flush().
+    // The stage and access flags describe how the resource is first used on the graphics queue.
+    void upload_buffer(VkBuffer buffer, VkDeviceSize offset, const void* data, VkDeviceSize size,
+        VkPipelineStageFlags dst_stage, VkAccessFlags dst_access);
+
+    // Submits the recorded uploads to the transfer queue. Returns the timeline value signaled when they are done.
+    uint64_t flush();
+
+    // Makes the flushed uploads available to work submitted to the graphics queue afterwards. The graphics
+    // queue waits for them on the GPU, the CPU never blocks. Call this right before submitting the frame that
+    // uses them, frame_value is the timeline value that frame signals.
+    void submit_acquires(uint64_t frame_value);
+
+    // Non-blocking, frees the staging memory and command buffers of uploads that finished and were acquired
+    // by frames up to completed_frame_value.
+    void collect(uint64_t completed_frame_value);
+
+    bool is_complete(uint64_t value);
+    void wait(uint64_t value);
+
+    VkSemaphore timeline_semaphore();
+}
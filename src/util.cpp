@@ -1,5 +1,32 @@
 #include "util.hpp"
 
+#include <stdexcept>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace
+{
+    const uint32_t SPIRV_MAGIC_NUMBER = 0x07230203;
+    const size_t SPIRV_HEADER_SIZE = 5 * sizeof(uint32_t);
+
+    void validate_spirv(const uint32_t* code, size_t size, const std::string& name)
+    {
+        if (size < SPIRV_HEADER_SIZE || size % sizeof(uint32_t) != 0 || code[0] != SPIRV_MAGIC_NUMBER)
+        {
+            throw std::runtime_error(name + " is not a valid SPIR-V module");
+        }
+    }
+}
+
 std::vector<char> em_util::read_file(const std::string& filename)
 {
     std::ifstream file(filename, std::ios::ate | std::ios::binary);
@@ -14,4 +41,105 @@ std::vector<char> em_util::read_file(const std::string& filename)
 
     file.close();
     return buffer;
-}
\ No newline at end of file
+}
+
+void em_util::write_file(const std::string& filename, const std::vector<char>& data)
+{
+    std::ofstream file(filename, std::ios::trunc | std::ios::binary);
+
+    if (!file.is_open()) throw std::runtime_error("Failed to open file " + filename);
+
+    file.write(data.data(), data.size());
+
+    file.close();
+}
+
+bool em_util::file_exists(const std::string& filename)
+{
+    std::ifstream file(filename);
+    return file.good();
+}
+
+em_util::SpirvCode em_util::map_spirv_file(const std::string& filename)
+{
+    SpirvCode spirv_code;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed to open file " + filename);
+
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    spirv_code.size = static_cast<size_t>(file_size.QuadPart);
+
+    if (spirv_code.size > 0)
+    {
+        HANDLE file_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (file_mapping != nullptr)
+        {
+            spirv_code.mapping = MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(file_mapping);
+        }
+    }
+
+    CloseHandle(file);
+#else
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0) throw std::runtime_error("Failed to open file " + filename);
+
+    struct stat file_stat;
+    fstat(file, &file_stat);
+    spirv_code.size = static_cast<size_t>(file_stat.st_size);
+
+    if (spirv_code.size > 0)
+    {
+        void* mapping = mmap(nullptr, spirv_code.size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping != MAP_FAILED) spirv_code.mapping = mapping;
+    }
+
+    // The mapping stays valid after closing the file.
+    close(file);
+#endif
+
+    if (spirv_code.size > 0 && spirv_code.mapping == nullptr) throw std::runtime_error("Failed to map file " + filename);
+
+    // Mappings are page aligned, so the code can be used as 32-bit words directly.
+    spirv_code.code = static_cast<const uint32_t*>(spirv_code.mapping);
+
+    try
+    {
+        validate_spirv(spirv_code.code, spirv_code.size, filename);
+    }
+    catch (...)
+    {
+        release_spirv_code(spirv_code);
+        throw;
+    }
+
+    return spirv_code;
+}
+
+em_util::SpirvCode em_util::wrap_spirv_code(const uint32_t* code, size_t size)
+{
+    validate_spirv(code, size, "Embedded shader");
+
+    SpirvCode spirv_code;
+    spirv_code.code = code;
+    spirv_code.size = size;
+
+    return spirv_code;
+}
+
+void em_util::release_spirv_code(SpirvCode& spirv_code)
+{
+    if (spirv_code.mapping != nullptr)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(spirv_code.mapping);
+#else
+        munmap(spirv_code.mapping, spirv_code.size);
+#endif
+    }
+
+    spirv_code = SpirvCode {};
+}
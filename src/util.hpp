@@ -3,8 +3,26 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <cstdint>
 
 namespace em_util
 {
+    // Read-only SPIR-V code, either memory mapped from a file or pointing into memory owned by someone else.
+    struct SpirvCode
+    {
+        const uint32_t* code = nullptr; // Always 4 byte aligned
+        size_t size = 0; // In bytes
+
+        void* mapping = nullptr; // Base of the file mapping, null if the code isn't mapped
+    };
+
     std::vector<char> read_file(const std::string& filename);
+    void write_file(const std::string& filename, const std::vector<char>& data);
+    bool file_exists(const std::string& filename);
+
+    // Maps a SPIR-V file into memory without copying it. Throws if it isn't valid SPIR-V.
+    SpirvCode map_spirv_file(const std::string& filename);
+    // Wraps SPIR-V code that is already in memory (e.g. embedded in the binary). Throws if it isn't valid SPIR-V.
+    SpirvCode wrap_spirv_code(const uint32_t* code, size_t size);
+    void release_spirv_code(SpirvCode& spirv_code);
 }
@@ -10,12 +10,40 @@
 #include <optional>
 #include <limits>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <cctype>
+#include <map>
+#include <mutex>
+#include <numeric>
 
 #include "util.hpp"
+#include "profiler.hpp"
+#include "memory.hpp"
+#include "workers.hpp"
+#include "allocation_counter.hpp"
+#include "shader_watcher.hpp"
+#include "frame_pacer.hpp"
+#include "upload.hpp"
+#include "frame_ring.hpp"
+#include "task_graph.hpp"
+
+#ifdef EM_EMBED_SHADERS
+    #include "embedded_shaders.hpp" // Generated at build time from the compiled shaders
+#endif
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// Configurable at launch, more frames in flight trade latency for throughput.
+uint32_t max_frames_in_flight = 2;
 uint32_t current_frame = 0;
 
+// Requested number of swap chain (or offscreen) images, 0 picks the default.
+uint32_t requested_swap_chain_image_count = 0;
+
 const std::vector<const char*> validation_layers = {
     "VK_LAYER_KHRONOS_validation"
 };
@@ -33,46 +61,398 @@ const std::vector<const char*> device_extensions = {
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 800;
 
+// Headless mode renders into offscreen images instead of a window, so no display is required.
+bool headless = false;
+uint32_t headless_frame_count = 1000;
+uint32_t headless_resize_interval = 0; // Resizes the offscreen targets every this many frames (0 never does)
+
 GLFWwindow* window;
 VkInstance vk_instance;
 VkSurfaceKHR surface;
 VkPhysicalDevice physical_device = VK_NULL_HANDLE;
 VkDevice device;
 
+// The suitable device with the highest score is used, unless one is picked with --device or the EM_DEVICE
+// environment variable (by index, UUID or part of its name). --device takes precedence.
+std::string device_selection;
+bool list_devices = false;
+
 VkQueue graphics_queue;
 VkQueue present_queue;
+VkQueue transfer_queue;
+
+// Frame synchronization. Every frame submission signals the next value of a timeline semaphore, so the value of
+// a frame is its position in submission order (see submitted_frame_count). The CPU polls or waits for values instead
+// of waiting on and resetting a fence per frame. Devices without timeline semaphores (Vulkan 1.2) use the fences.
+// Uploads also need timeline semaphores, without them they're copied synchronously on the graphics queue.
+bool use_timeline_semaphores = false;
+VkSemaphore frame_timeline = VK_NULL_HANDLE;
+uint64_t completed_frames = 0; // Highest frame value known to have finished
 
 VkSwapchainKHR swap_chain;
 std::vector<VkImage> swap_chain_images;
 std::vector<VkImageView> swap_chain_image_views;
-VkFormat swap_chain_image_format;
+VkSurfaceFormatKHR swap_chain_surface_format;
+VkFormat swap_chain_image_format; // Picked with the device, so the pipeline doesn't have to wait for the swap chain
 VkExtent2D swap_chain_extent;
 
+// Attachments that only live during the render pass. They're never stored, so they are transient attachments in
+// lazily allocated memory where the device has it (tile based GPUs then keep them on chip).
+struct RenderTarget
+{
+    VkImage image;
+    em_memory::Allocation memory;
+    VkImageView view;
+};
+
+bool render_targets_lazily_allocated = false;
+VkDeviceSize render_target_bytes = 0; // Per swap chain image
+
+// Reverse-Z depth buffer, one per swap chain image. Depth is cleared to 0 (far) and tested with GREATER, which spreads
+// the float precision evenly. Depth testing lets early-Z reject overdrawn fragments before they are shaded.
+VkFormat depth_format;
+std::vector<RenderTarget> depth_targets;
+bool depth_test = true; // --no-depth-test disables it, for comparison
+
+// MSAA renders into a multisampled color target (one per swap chain image), which the render pass resolves into
+// the swap chain image at the end. --msaa picks the sample count, limited to what the device supports.
+uint32_t requested_msaa_samples = 1;
+VkSampleCountFlagBits msaa_samples = VK_SAMPLE_COUNT_1_BIT;
+std::vector<RenderTarget> msaa_color_targets; // Empty without MSAA
+
 VkRenderPass render_pass;
+VkDescriptorSetLayout descriptor_set_layout;
 VkPipelineLayout pipeline_layout;
 VkPipeline graphics_pipeline;
 
+// Vulkan 1.3 dynamic rendering with synchronization2 barriers, used instead of the render pass and
+// framebuffers when the device supports it.
+uint32_t instance_api_version = VK_API_VERSION_1_0;
+bool use_dynamic_rendering = false;
+bool force_legacy_render_pass = false;
+bool run_render_path_benchmark = false;
+
+// Shader hot reload. Pipelines are rebuilt on a background thread and swapped in at the start of a frame.
+struct RetiredPipeline
+{
+    VkPipeline pipeline;
+    uint64_t last_frame; // Number of frames submitted while the pipeline was in use
+};
+
+bool hot_reload_shaders = false;
+std::thread pipeline_rebuild_thread;
+std::atomic<bool> pipeline_rebuild_running {false};
+bool pipeline_rebuild_requested = false;
+bool pipeline_rebuild_compiles = false; // The running rebuild recompiles the GLSL sources first
+bool shader_compile_requested = false;
+std::atomic<VkPipeline> rebuilt_pipeline {VK_NULL_HANDLE};
+std::deque<RetiredPipeline> retired_pipelines;
+uint64_t submitted_frame_count = 0; // Also the value of the last submitted frame
+
+// Startup runs as a task graph (see init_vulkan), --serial-startup runs the same tasks one after the other.
+bool serial_startup = false;
+std::chrono::steady_clock::time_point launch_time;
+bool first_frame_reported = false;
+
+// SPIR-V loaded by a startup task before the device exists. Every entry is used once, by the first pipeline build.
+std::map<std::string, em_util::SpirvCode> preloaded_shader_code;
+std::mutex preloaded_shader_mutex;
+double graphics_shader_preload_ms = 0.0; // Reading the graphics pipeline's SPIR-V in the startup task, part of shader_load_ms
+
+// Pipeline cache persisted between launches so pipelines don't have to be compiled from scratch every time.
+std::string pipeline_cache_path = "pipeline_cache.bin";
+VkPipelineCache pipeline_cache;
+bool pipeline_cache_warm = false;
+
 std::vector<VkFramebuffer> swap_chain_framebuffers;
 
+// Geometry
+struct Vertex
+{
+    float position[2];
+    float color[3];
+
+    static VkVertexInputBindingDescription get_binding_description()
+    {
+        VkVertexInputBindingDescription binding_description {};
+        binding_description.binding = 0;
+        binding_description.stride = sizeof(Vertex);
+        binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+        return binding_description;
+    }
+};
+
+// Per-instance data, every instance is the same triangle scaled and moved somewhere else.
+struct InstanceData
+{
+    float offset[2];
+    float scale;
+    float depth; // Reverse-Z, 1 is the nearest
+    uint32_t draw; // Index of the draw call's uniforms
+
+    static VkVertexInputBindingDescription get_binding_description()
+    {
+        VkVertexInputBindingDescription binding_description {};
+        binding_description.binding = 1;
+        binding_description.stride = sizeof(InstanceData);
+        binding_description.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+        return binding_description;
+    }
+};
+
+std::array<VkVertexInputAttributeDescription, 6> get_attribute_descriptions()
+{
+    std::array<VkVertexInputAttributeDescription, 6> attribute_descriptions {};
+
+    // Vertex attributes (binding 0)
+    attribute_descriptions[0].binding = 0;
+    attribute_descriptions[0].location = 0;
+    attribute_descriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
+    attribute_descriptions[0].offset = offsetof(Vertex, position);
+
+    attribute_descriptions[1].binding = 0;
+    attribute_descriptions[1].location = 1;
+    attribute_descriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+    attribute_descriptions[1].offset = offsetof(Vertex, color);
+
+    // Instance attributes (binding 1)
+    attribute_descriptions[2].binding = 1;
+    attribute_descriptions[2].location = 2;
+    attribute_descriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
+    attribute_descriptions[2].offset = offsetof(InstanceData, offset);
+
+    attribute_descriptions[3].binding = 1;
+    attribute_descriptions[3].location = 3;
+    attribute_descriptions[3].format = VK_FORMAT_R32_SFLOAT;
+    attribute_descriptions[3].offset = offsetof(InstanceData, scale);
+
+    attribute_descriptions[4].binding = 1;
+    attribute_descriptions[4].location = 4;
+    attribute_descriptions[4].format = VK_FORMAT_R32_SFLOAT;
+    attribute_descriptions[4].offset = offsetof(InstanceData, depth);
+
+    attribute_descriptions[5].binding = 1;
+    attribute_descriptions[5].location = 5;
+    attribute_descriptions[5].format = VK_FORMAT_R32_UINT;
+    attribute_descriptions[5].offset = offsetof(InstanceData, draw);
+
+    return attribute_descriptions;
+}
+
+const std::vector<Vertex> vertices = {
+    {{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
+    {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
+    {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}}
+};
+
+// Number of triangles drawn every frame, can be raised on the command line to stress the renderer.
+uint32_t instance_count = 1;
+// The instances are split evenly over this many draw calls, to simulate a scene with many separate objects.
+uint32_t draw_call_count = 1;
+
+VkBuffer vertex_buffer;
+em_memory::Allocation vertex_buffer_memory;
+VkBuffer instance_buffer;
+em_memory::Allocation instance_buffer_memory;
+
+// Per draw call uniforms (std430, matches DrawUniforms in triangle.vert). Without --animate they never change and
+// are uploaded once. Animated uniforms are written to the frame ring buffer every frame, by the CPU while recording
+// or by the culling shader with --gpu-driven, and bound once with a dynamic offset.
+struct DrawUniforms
+{
+    float tint[4];
+    float rotation; // Radians
+    float padding[3]; // The array stride is rounded up to the alignment of the vec4
+};
+
+// Pushed once per command buffer (matches FrameConstants in triangle.vert).
+struct FrameConstants
+{
+    float time; // Seconds since the animation started
+    float zoom;
+};
+
+VkDescriptorPool descriptor_pool;
+VkDescriptorSet draw_uniforms_descriptor_set; // Frame ring buffer
+uint32_t draw_uniforms_offset = 0; // Of this frame's uniforms in the frame ring buffer
+VkBuffer static_draw_uniforms_buffer;
+em_memory::Allocation static_draw_uniforms_memory;
+VkDescriptorSet static_draw_uniforms_descriptor_set;
+
+// --animate spins and tints every draw call, otherwise the uniforms are constant (but still uploaded every frame).
+bool animate = false;
+std::chrono::steady_clock::time_point animation_start_time = std::chrono::steady_clock::now();
+float frame_time = 0.0f;
+
+// Zooms the view in, so objects outside of it can be culled.
+float view_zoom = 1.0f;
+// Scales every instance, above 1 they overlap each other to create overdraw.
+float instance_overlap = 1.0f;
+
+// Every draw call (object) is at a fixed depth. With --sort-front-to-back the opaque draws are recorded nearest first,
+// so early-Z rejects the fragments behind them. Objects don't move, so the order is only sorted once.
+bool sort_front_to_back = false;
+std::vector<uint32_t> draw_order;
+
+// Pipeline statistics queries count the shaded fragments, when the device supports them.
+bool supports_pipeline_statistics = false;
+bool supports_inherited_queries = false;
+
+// GPU-driven rendering (Vulkan 1.2 drawIndirectCount). Every draw call is an object, a compute shader frustum culls
+// the objects and writes an indirect draw for each visible one, which are all drawn by a single vkCmdDrawIndirectCount.
+// Otherwise the CPU culls the objects and records a draw call for each visible one.
+struct ObjectData // std430, matches Object in cull.comp
+{
+    float bounds_min[2];
+    float bounds_max[2];
+    uint32_t first_instance;
+    uint32_t instance_count;
+};
+
+struct CullConstants // Matches CullConstants in cull.comp
+{
+    float zoom;
+    uint32_t object_count;
+    uint32_t vertex_count;
+    float time;
+    uint32_t animate; // Write the animated uniforms of the visible objects
+};
+
+const uint32_t CULL_WORKGROUP_SIZE = 64;
+
+// The indirect buffers start with the draw count, the commands follow at the largest storage buffer offset alignment allowed.
+const VkDeviceSize INDIRECT_COMMANDS_OFFSET = 256;
+
+bool supports_gpu_driven_rendering = false;
+bool gpu_driven_rendering = false;
+bool run_cull_benchmark = false;
+
+std::vector<ObjectData> objects;
+VkBuffer object_buffer = VK_NULL_HANDLE;
+em_memory::Allocation object_buffer_memory;
+std::vector<VkBuffer> indirect_buffers; // Per frame in flight
+std::vector<em_memory::Allocation> indirect_buffer_memory;
+
+VkDescriptorSetLayout cull_descriptor_set_layout;
+VkDescriptorPool cull_descriptor_pool;
+std::vector<VkDescriptorSet> cull_descriptor_sets; // Per frame in flight
+VkPipelineLayout cull_pipeline_layout;
+VkPipeline cull_pipeline = VK_NULL_HANDLE;
+
+// Backing memory of the offscreen render targets (headless mode only)
+std::vector<em_memory::Allocation> offscreen_image_memory;
+uint32_t next_offscreen_image = 0;
+
 VkCommandPool command_pool;
 std::vector<VkCommandBuffer> command_buffers;
 
+// Multithreaded recording. Every worker thread records a slice of the draw calls into its own secondary
+// command buffer, allocated from a command pool per frame in flight. 0 threads records inline on the main thread.
+uint32_t record_thread_count = 0;
+std::vector<std::vector<VkCommandPool>> worker_command_pools; // [frame][thread]
+std::vector<std::vector<VkCommandBuffer>> worker_command_buffers; // [frame][thread]
+bool run_record_benchmark = false;
+
 std::vector<VkSemaphore> image_available_semaphores;
 std::vector<VkSemaphore> render_finished_semaphores;
-std::vector<VkFence>  in_flight_fences;
+std::vector<VkFence> in_flight_fences; // Only without timeline semaphores
+std::vector<uint64_t> frame_slot_values; // Value of the last frame submitted from each frame slot
+std::vector<uint64_t> image_frame_values; // Value of the last frame rendering into each swap chain image
 
 bool framebuffer_resized = false;
 
-void init_window()
+// Swap chain resources replaced by a resize. They are destroyed once the frames using them have finished,
+// so resizing doesn't have to wait for the device to go idle.
+struct RetiredSwapChain
+{
+    VkSwapchainKHR swap_chain = VK_NULL_HANDLE;
+    std::vector<VkImageView> image_views;
+    std::vector<VkFramebuffer> framebuffers;
+    std::vector<RenderTarget> depth_targets;
+    std::vector<RenderTarget> msaa_color_targets;
+    uint64_t last_frame = 0; // Number of frames submitted while it was in use
+    bool in_use = false;
+};
+
+std::vector<RetiredSwapChain> retired_swap_chains; // Fixed number of slots, so resizing doesn't allocate
+bool resize_wait_idle = false; // Old resize path (vkDeviceWaitIdle and a full teardown), for comparison
+
+// Present mode selection, picked at launch to benchmark throughput vs latency.
+enum PresentModePolicy
+{
+    PRESENT_POLICY_DEFAULT, // Mailbox if available, FIFO otherwise
+    PRESENT_POLICY_IMMEDIATE,
+    PRESENT_POLICY_MAILBOX,
+    PRESENT_POLICY_FIFO,
+    PRESENT_POLICY_FIFO_RELAXED,
+    PRESENT_POLICY_LOWEST_LATENCY
+};
+
+PresentModePolicy present_mode_policy = PRESENT_POLICY_DEFAULT;
+VkPresentModeKHR swap_chain_present_mode;
+
+// Input-to-present latency tracking. The first input event after a frame started is timestamped,
+// the latency is measured once the next frame (which is the first one that can react to it) is presented.
+bool input_pending = false;
+std::chrono::steady_clock::time_point input_time;
+
+struct PresentStatistics
+{
+    uint64_t presented_frames = 0;
+    std::chrono::steady_clock::time_point start_time;
+
+    uint64_t latency_samples = 0;
+    double latency_total_ms = 0.0;
+    double latency_max_ms = 0.0;
+
+    uint64_t resize_count = 0;
+    double resize_total_ms = 0.0;
+    double resize_max_ms = 0.0;
+};
+
+PresentStatistics present_statistics;
+
+// VK_KHR_present_wait bounds the number of presents queued ahead of the display, on top of the frame rate cap.
+uint32_t max_queued_presents = 0; // 0 doesn't wait
+bool use_present_wait = false;
+uint64_t present_id = 0; // Id of the last present
+uint64_t swap_chain_first_present_id = 1; // Ids presented to an older swap chain can't be waited on
+PFN_vkWaitForPresentKHR wait_for_present = nullptr;
+
+// Where the frame timings are written on exit (empty to only print the summary)
+std::string profile_output_path;
+std::string metrics_output_path; // Prometheus text (.prom) or CSV for dashboards
+
+void record_input_event()
 {
-    glfwInit();
+    if (input_pending) return;
+
+    input_pending = true;
+    input_time = std::chrono::steady_clock::now();
+}
 
+// glfwInit() has to be called first.
+void init_window()
+{
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 
     window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
     glfwSetFramebufferSizeCallback(window, [](GLFWwindow* window, int width, int height) {
         framebuffer_resized = true;
     });
+
+    // Any input counts for the latency measurements.
+    glfwSetKeyCallback(window, [](GLFWwindow* window, int key, int scancode, int action, int mods) {
+        record_input_event();
+    });
+    glfwSetMouseButtonCallback(window, [](GLFWwindow* window, int button, int action, int mods) {
+        record_input_event();
+    });
+    glfwSetCursorPosCallback(window, [](GLFWwindow* window, double x, double y) {
+        record_input_event();
+    });
 }
 
 /* #region Vulkan Initialization Functions */
@@ -81,6 +461,7 @@ struct QueueFamilyIndices
 {
     std::optional<uint32_t> graphics_family;
     std::optional<uint32_t> present_family;
+    std::optional<uint32_t> transfer_family; // A transfer only family if there is one, the graphics family otherwise
 };
 
 struct SwapChainSupportDetails
@@ -90,6 +471,11 @@ struct SwapChainSupportDetails
     std::vector<VkPresentModeKHR> present_modes;
 };
 
+// Queried once for the picked device, so recreating the swap chain doesn't have to query (and allocate) again.
+// Only the surface capabilities change at runtime, those are refreshed in create_swap_chain().
+QueueFamilyIndices device_queue_families;
+SwapChainSupportDetails device_swap_chain_support;
+
 bool check_validation_layer_support()
 {
     // Get available validation layers.
@@ -155,6 +541,20 @@ QueueFamilyIndices find_queue_families(VkPhysicalDevice device)
             indices.graphics_family = i;
         }
 
+        // Families without graphics and compute are usually backed by dedicated copy engines.
+        if ((queue_family.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queue_family.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+        {
+            indices.transfer_family = i;
+        }
+
+        // There is no surface to present to in headless mode, the graphics queue is used for everything.
+        if (headless)
+        {
+            indices.present_family = indices.graphics_family;
+            i++;
+            continue;
+        }
+
         VkBool32 presentSupport = false;
         vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
         if (presentSupport) 
@@ -165,6 +565,9 @@ QueueFamilyIndices find_queue_families(VkPhysicalDevice device)
         i++;
     }
 
+    // Graphics queues always support transfers.
+    if (!indices.transfer_family.has_value()) indices.transfer_family = indices.graphics_family;
+
     return indices;
 }
 
@@ -209,6 +612,12 @@ bool is_device_suitable(VkPhysicalDevice device)
     // Get the queue indices
     QueueFamilyIndices indices = find_queue_families(device);
 
+    // Headless rendering doesn't need a swap chain, only a graphics queue.
+    if (headless)
+    {
+        return indices.graphics_family.has_value();
+    }
+
     // Check if the required extensions are supported by the physical device (gpu)
     bool extensions_supported = check_device_extension_support(device);
 
@@ -228,7 +637,194 @@ bool is_device_suitable(VkPhysicalDevice device)
         indices.present_family.has_value(); // Gpu needs to have present queue family.
 }
 
-void pick_physical_device()
+bool supports_dynamic_rendering(VkPhysicalDevice device)
+{
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(device, &device_properties);
+
+    if (instance_api_version < VK_API_VERSION_1_3 || device_properties.apiVersion < VK_API_VERSION_1_3) return false;
+
+    VkPhysicalDeviceVulkan13Features vulkan_13_features {};
+    vulkan_13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+
+    VkPhysicalDeviceFeatures2 features {};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &vulkan_13_features;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+
+    return vulkan_13_features.dynamicRendering && vulkan_13_features.synchronization2;
+}
+
+bool supports_present_wait(VkPhysicalDevice device)
+{
+    if (instance_api_version < VK_API_VERSION_1_1) return false;
+
+    uint32_t extension_count;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count, nullptr);
+
+    std::vector<VkExtensionProperties> available_extensions(extension_count);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count, available_extensions.data());
+
+    std::set<std::string> required_extensions = {VK_KHR_PRESENT_ID_EXTENSION_NAME, VK_KHR_PRESENT_WAIT_EXTENSION_NAME};
+    for (VkExtensionProperties extension : available_extensions) {
+        required_extensions.erase(extension.extensionName);
+    }
+
+    if (!required_extensions.empty()) return false;
+
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features {};
+    present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features {};
+    present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_id_features.pNext = &present_wait_features;
+
+    VkPhysicalDeviceFeatures2 features {};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &present_id_features;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+
+    return present_id_features.presentId && present_wait_features.presentWait;
+}
+
+// All features are false below Vulkan 1.2.
+VkPhysicalDeviceVulkan12Features query_vulkan_12_features(VkPhysicalDevice device)
+{
+    VkPhysicalDeviceVulkan12Features vulkan_12_features {};
+    vulkan_12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(device, &device_properties);
+
+    if (instance_api_version < VK_API_VERSION_1_2 || device_properties.apiVersion < VK_API_VERSION_1_2) return vulkan_12_features;
+
+    VkPhysicalDeviceFeatures2 features {};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &vulkan_12_features;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+
+    return vulkan_12_features;
+}
+
+/* #region Device Selection */
+
+const char* device_type_name(VkPhysicalDeviceType type)
+{
+    switch (type)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: return "cpu";
+        default: return "other";
+    }
+}
+
+// Formatted like 01234567-89ab-cdef-0123-456789abcdef, empty if the instance can't query it (Vulkan 1.0).
+std::string device_uuid(VkPhysicalDevice device)
+{
+    if (instance_api_version < VK_API_VERSION_1_1) return "";
+
+    VkPhysicalDeviceIDProperties id_properties {};
+    id_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+
+    VkPhysicalDeviceProperties2 properties {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &id_properties;
+    vkGetPhysicalDeviceProperties2(device, &properties);
+
+    const char* hex_digits = "0123456789abcdef";
+    std::string uuid;
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10) uuid += '-';
+        uuid += hex_digits[id_properties.deviceUUID[i] >> 4];
+        uuid += hex_digits[id_properties.deviceUUID[i] & 0xF];
+    }
+
+    return uuid;
+}
+
+// Higher is faster. The device type dominates, the rest mostly orders devices of the same type.
+uint64_t score_device(VkPhysicalDevice device)
+{
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(device, &device_properties);
+
+    uint64_t score = 0;
+    switch (device_properties.deviceType)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score += 100000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 50000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score += 20000; break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: score += 1000; break; // Software rasterizers like lavapipe
+        default: break;
+    }
+
+    // 100 points per GiB of device local memory. Integrated GPUs and CPUs report system memory here, so it's capped.
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(device, &memory_properties);
+
+    VkDeviceSize device_local_bytes = 0;
+    for (uint32_t i = 0; i < memory_properties.memoryHeapCount; i++)
+    {
+        if (memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) device_local_bytes += memory_properties.memoryHeaps[i].size;
+    }
+    score += std::min<uint64_t>(device_local_bytes >> 30, 32) * 100;
+
+    // Limits that grow with the size of the hardware
+    score += device_properties.limits.maxImageDimension2D / 1024;
+    score += device_properties.limits.maxComputeSharedMemorySize / 4096;
+
+    // Queues that run uploads and compute work alongside rendering
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, nullptr);
+
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, queue_families.data());
+
+    bool dedicated_transfer = false, async_compute = false;
+    for (const VkQueueFamilyProperties& queue_family : queue_families)
+    {
+        bool graphics = queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT;
+        bool compute = queue_family.queueFlags & VK_QUEUE_COMPUTE_BIT;
+
+        if (!graphics && !compute && (queue_family.queueFlags & VK_QUEUE_TRANSFER_BIT)) dedicated_transfer = true;
+        if (!graphics && compute) async_compute = true;
+    }
+    if (dedicated_transfer) score += 500;
+    if (async_compute) score += 500;
+
+    // Optional features the renderer uses
+    VkPhysicalDeviceVulkan12Features vulkan_12_features = query_vulkan_12_features(device);
+    if (vulkan_12_features.timelineSemaphore) score += 200;
+    if (vulkan_12_features.drawIndirectCount) score += 200;
+    if (supports_dynamic_rendering(device)) score += 200;
+
+    return score;
+}
+
+// Matches an index, a UUID or (case insensitive) part of the device name.
+bool matches_device_selection(VkPhysicalDevice device, uint32_t index)
+{
+    auto to_lower = [](std::string text) {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return text;
+    };
+
+    if (std::all_of(device_selection.begin(), device_selection.end(), [](unsigned char c) { return std::isdigit(c); }))
+    {
+        return std::stoul(device_selection) == index;
+    }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(device, &device_properties);
+
+    std::string selection = to_lower(device_selection);
+    return selection == device_uuid(device) || to_lower(device_properties.deviceName).find(selection) != std::string::npos;
+}
+
+std::vector<VkPhysicalDevice> enumerate_physical_devices()
 {
     uint32_t device_count = 0;
     vkEnumeratePhysicalDevices(vk_instance, &device_count, nullptr);
@@ -241,27 +837,122 @@ void pick_physical_device()
     std::vector<VkPhysicalDevice> devices(device_count);
     vkEnumeratePhysicalDevices(vk_instance, &device_count, devices.data());
 
-    for (VkPhysicalDevice device : devices)
+    return devices;
+}
+
+void print_physical_devices()
+{
+    std::vector<VkPhysicalDevice> devices = enumerate_physical_devices();
+
+    for (uint32_t i = 0; i < devices.size(); i++)
+    {
+        VkPhysicalDeviceProperties device_properties;
+        vkGetPhysicalDeviceProperties(devices[i], &device_properties);
+
+        std::cout << i << ": " << device_properties.deviceName << " (" << device_type_name(device_properties.deviceType)
+            << ", Vulkan " << VK_VERSION_MAJOR(device_properties.apiVersion) << "." << VK_VERSION_MINOR(device_properties.apiVersion)
+            << ") score " << score_device(devices[i]) << (is_device_suitable(devices[i]) ? "" : ", not suitable") << std::endl;
+
+        std::string uuid = device_uuid(devices[i]);
+        if (!uuid.empty()) std::cout << "   uuid " << uuid << std::endl;
+    }
+}
+
+/* #endregion */
+
+// Highest sample count up to the requested one that both the color and the depth attachments support.
+VkSampleCountFlagBits choose_msaa_samples(const VkPhysicalDeviceProperties& device_properties)
+{
+    VkSampleCountFlags supported = device_properties.limits.framebufferColorSampleCounts & device_properties.limits.framebufferDepthSampleCounts;
+
+    uint32_t samples = requested_msaa_samples;
+    while (samples > 1 && !(supported & samples)) samples >>= 1;
+
+    if (samples != requested_msaa_samples)
+    {
+        std::cout << requested_msaa_samples << "x MSAA is not supported, using " << samples << "x instead." << std::endl;
+    }
+
+    return static_cast<VkSampleCountFlagBits>(samples);
+}
+
+void pick_physical_device()
+{
+    std::vector<VkPhysicalDevice> devices = enumerate_physical_devices();
+    uint64_t best_score = 0;
+
+    for (uint32_t i = 0; i < devices.size(); i++)
     {
-        if (is_device_suitable(device))
+        if (!device_selection.empty())
         {
-            physical_device = device;
+            if (!matches_device_selection(devices[i], i)) continue;
+            if (!is_device_suitable(devices[i])) throw std::runtime_error("The selected GPU " + device_selection + " is not suitable.");
+
+            physical_device = devices[i];
             break;
         }
+
+        if (!is_device_suitable(devices[i])) continue;
+
+        uint64_t score = score_device(devices[i]);
+        if (physical_device == VK_NULL_HANDLE || score > best_score)
+        {
+            physical_device = devices[i];
+            best_score = score;
+        }
     }
 
     if (physical_device == VK_NULL_HANDLE)
     {
+        if (!device_selection.empty()) throw std::runtime_error("No GPU matches " + device_selection + ".");
         throw std::runtime_error("Failed to find a suitable GPU.");
     }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(physical_device, &device_properties);
+    std::cout << "Using " << device_properties.deviceName << " (" << device_type_name(device_properties.deviceType) << ")" << std::endl;
+
+    device_queue_families = find_queue_families(physical_device);
+    if (!headless) device_swap_chain_support = query_swap_chain_support(physical_device);
+
+    use_dynamic_rendering = !force_legacy_render_pass && supports_dynamic_rendering(physical_device);
+    VkPhysicalDeviceVulkan12Features vulkan_12_features = query_vulkan_12_features(physical_device);
+    use_timeline_semaphores = vulkan_12_features.timelineSemaphore;
+    supports_gpu_driven_rendering = vulkan_12_features.drawIndirectCount;
+
+    VkPhysicalDeviceFeatures device_features;
+    vkGetPhysicalDeviceFeatures(physical_device, &device_features);
+    supports_pipeline_statistics = device_features.pipelineStatisticsQuery;
+    supports_inherited_queries = device_features.inheritedQueries;
+
+    msaa_samples = choose_msaa_samples(device_properties);
+
+    std::cout << "Rendering with " << (use_dynamic_rendering ? "dynamic rendering" : "a render pass and framebuffers") << std::endl;
+
+    if (gpu_driven_rendering && !supports_gpu_driven_rendering)
+    {
+        std::cout << "drawIndirectCount is not supported, culling on the CPU instead." << std::endl;
+        gpu_driven_rendering = false;
+    }
+
+    if (gpu_driven_rendering && sort_front_to_back)
+    {
+        std::cout << "The culling shader writes the draws in any order, --sort-front-to-back only sorts the CPU path." << std::endl;
+    }
+
+    if (max_queued_presents > 0 && !headless)
+    {
+        use_present_wait = supports_present_wait(physical_device);
+        if (!use_present_wait) std::cout << "VK_KHR_present_wait is not supported, the number of queued presents is not limited." << std::endl;
+    }
 }
 
 void create_logical_device()
 {
-    QueueFamilyIndices indices = find_queue_families(physical_device);
+    const QueueFamilyIndices& indices = device_queue_families;
 
     std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
-    std::set<uint32_t> unique_queue_families = {indices.graphics_family.value(), indices.present_family.value()};
+    std::set<uint32_t> unique_queue_families = {indices.graphics_family.value(), indices.present_family.value(), indices.transfer_family.value()};
 
     float queue_priority = 1.0f;
     for (uint32_t queue_family : unique_queue_families)
@@ -276,6 +967,8 @@ void create_logical_device()
 
     // Specify features
     VkPhysicalDeviceFeatures device_features {};
+    device_features.pipelineStatisticsQuery = supports_pipeline_statistics;
+    device_features.inheritedQueries = supports_inherited_queries;
 
     // Create device
     VkDeviceCreateInfo create_info {};
@@ -286,9 +979,57 @@ void create_logical_device()
 
     create_info.pEnabledFeatures = &device_features;
 
-    // Enable device extensions
-    create_info.enabledExtensionCount = static_cast<uint32_t>(device_extensions.size());
-    create_info.ppEnabledExtensionNames = device_extensions.data();
+    VkPhysicalDeviceVulkan13Features vulkan_13_features {};
+    vulkan_13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    vulkan_13_features.dynamicRendering = VK_TRUE;
+    vulkan_13_features.synchronization2 = VK_TRUE;
+
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features {};
+    present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    present_wait_features.presentWait = VK_TRUE;
+
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features {};
+    present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_id_features.presentId = VK_TRUE;
+    present_id_features.pNext = &present_wait_features;
+
+    VkPhysicalDeviceVulkan12Features vulkan_12_features {};
+    vulkan_12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan_12_features.timelineSemaphore = use_timeline_semaphores;
+    vulkan_12_features.drawIndirectCount = supports_gpu_driven_rendering;
+
+    // Optional features are chained in front of each other.
+    void* feature_chain = nullptr;
+    if (use_timeline_semaphores || supports_gpu_driven_rendering)
+    {
+        vulkan_12_features.pNext = feature_chain;
+        feature_chain = &vulkan_12_features;
+    }
+    if (use_dynamic_rendering)
+    {
+        vulkan_13_features.pNext = feature_chain;
+        feature_chain = &vulkan_13_features;
+    }
+    if (use_present_wait)
+    {
+        present_wait_features.pNext = feature_chain;
+        feature_chain = &present_id_features;
+    }
+    create_info.pNext = feature_chain;
+
+    std::vector<const char*> enabled_extensions = device_extensions;
+    if (use_present_wait)
+    {
+        enabled_extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        enabled_extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
+
+    // Enable device extensions (the swap chain extension is not needed in headless mode)
+    if (!headless)
+    {
+        create_info.enabledExtensionCount = static_cast<uint32_t>(enabled_extensions.size());
+        create_info.ppEnabledExtensionNames = enabled_extensions.data();
+    }
 
     if (enable_validation_layers)
     {
@@ -307,6 +1048,13 @@ void create_logical_device()
 
     vkGetDeviceQueue(device, indices.graphics_family.value(), 0, &graphics_queue);
     vkGetDeviceQueue(device, indices.present_family.value(), 0, &present_queue);
+    vkGetDeviceQueue(device, indices.transfer_family.value(), 0, &transfer_queue);
+
+    if (use_present_wait)
+    {
+        wait_for_present = reinterpret_cast<PFN_vkWaitForPresentKHR>(vkGetDeviceProcAddr(device, "vkWaitForPresentKHR"));
+        if (wait_for_present == nullptr) use_present_wait = false;
+    }
 }
 
 void create_vulkan_instance()
@@ -322,7 +1070,14 @@ void create_vulkan_instance()
     app_info.applicationVersion = VK_MAKE_VERSION(0, 1, 0);
     app_info.pEngineName = "No Engine";
     app_info.engineVersion = VK_MAKE_VERSION(0, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
+
+    // Vulkan 1.0 loaders don't have vkEnumerateInstanceVersion and reject any higher API version.
+    PFN_vkEnumerateInstanceVersion enumerate_instance_version =
+        reinterpret_cast<PFN_vkEnumerateInstanceVersion>(vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+    if (enumerate_instance_version != nullptr) enumerate_instance_version(&instance_api_version);
+
+    instance_api_version = std::min(instance_api_version, static_cast<uint32_t>(VK_API_VERSION_1_3));
+    app_info.apiVersion = instance_api_version;
 
     VkInstanceCreateInfo create_info {};
     create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -330,9 +1085,13 @@ void create_vulkan_instance()
 
     // Setup extensions from the built in glfw function
     uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
+    const char** glfwExtensions = nullptr;
 
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    // Headless mode has no window, so no surface extensions are required.
+    if (!headless)
+    {
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    }
 
     create_info.enabledExtensionCount = glfwExtensionCount;
     create_info.ppEnabledExtensionNames = glfwExtensions;
@@ -379,21 +1138,56 @@ VkSurfaceFormatKHR choose_swap_surface_format(const std::vector<VkSurfaceFormatK
     return available_formats[0]; // Return first format specified
 }
 
-VkPresentModeKHR choose_swap_present_mode(const std::vector<VkPresentModeKHR>& available_present_modes)
+const char* present_mode_name(VkPresentModeKHR present_mode)
 {
-    // Check if preferred format is available.
-    for (VkPresentModeKHR available_present_mode : available_present_modes)
+    switch (present_mode)
     {
-        if (available_present_mode == VK_PRESENT_MODE_MAILBOX_KHR)
-        {
-            return available_present_mode; // Return preferred present mode
-        }
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "mailbox";
+        case VK_PRESENT_MODE_FIFO_KHR: return "fifo";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "fifo_relaxed";
+        default: return "unknown";
     }
-
-    return VK_PRESENT_MODE_FIFO_KHR; // Return guaranteed present mode
 }
 
-VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR& capabilities)
+VkPresentModeKHR choose_swap_present_mode(const std::vector<VkPresentModeKHR>& available_present_modes)
+{
+    // Present modes to try in order of preference, FIFO is always available so it's the last resort.
+    // A fixed size array, since this runs on every swap chain recreation.
+    VkPresentModeKHR preferred_modes[3];
+    uint32_t preferred_mode_count = 0;
+
+    switch (present_mode_policy)
+    {
+        case PRESENT_POLICY_DEFAULT: preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_MAILBOX_KHR; break;
+        case PRESENT_POLICY_IMMEDIATE: preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_IMMEDIATE_KHR; break;
+        case PRESENT_POLICY_MAILBOX: preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_MAILBOX_KHR; break;
+        case PRESENT_POLICY_FIFO: break;
+        case PRESENT_POLICY_FIFO_RELAXED: preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_FIFO_RELAXED_KHR; break;
+        case PRESENT_POLICY_LOWEST_LATENCY:
+            preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_MAILBOX_KHR;
+            preferred_modes[preferred_mode_count++] = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+            break;
+    }
+
+    for (uint32_t i = 0; i < preferred_mode_count; i++)
+    {
+        if (std::find(available_present_modes.begin(), available_present_modes.end(), preferred_modes[i]) != available_present_modes.end())
+        {
+            return preferred_modes[i]; // Return preferred present mode
+        }
+    }
+
+    if (present_mode_policy != PRESENT_POLICY_DEFAULT && present_mode_policy != PRESENT_POLICY_FIFO)
+    {
+        std::cout << "Requested present mode is not supported, falling back to fifo." << std::endl;
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR; // Return guaranteed present mode
+}
+
+VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR& capabilities)
 {
     if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max())
     {
@@ -417,15 +1211,21 @@ VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR& capabilities)
 }
 
 // Swap chain creation
-void create_swap_chain()
+// Passing the old swap chain lets the driver reuse its resources and keep presenting its images.
+void create_swap_chain(VkSwapchainKHR old_swap_chain = VK_NULL_HANDLE)
 {
-    SwapChainSupportDetails swap_chain_support_details = query_swap_chain_support(physical_device);
+    SwapChainSupportDetails& swap_chain_support_details = device_swap_chain_support;
 
-    VkSurfaceFormatKHR surface_format = choose_swap_surface_format(swap_chain_support_details.formats);
+    // The surface size (and with it the capabilities) change when the window is resized.
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &swap_chain_support_details.capabilites);
+
+    const VkSurfaceFormatKHR& surface_format = swap_chain_surface_format;
     VkPresentModeKHR present_mode = choose_swap_present_mode(swap_chain_support_details.present_modes);
     VkExtent2D extent = choose_swap_extent(swap_chain_support_details.capabilites);
 
-    uint32_t swap_chain_image_count = swap_chain_support_details.capabilites.minImageCount + 1;
+    uint32_t swap_chain_image_count = requested_swap_chain_image_count != 0 ?
+        std::max(requested_swap_chain_image_count, swap_chain_support_details.capabilites.minImageCount) :
+        swap_chain_support_details.capabilites.minImageCount + 1;
 
     // Make sure to not exceed the maximum number of images
     if (swap_chain_support_details.capabilites.maxImageCount > 0 && 
@@ -444,7 +1244,7 @@ void create_swap_chain()
     create_info.imageArrayLayers = 1;
     create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 
-    QueueFamilyIndices indices = find_queue_families(physical_device);
+    const QueueFamilyIndices& indices = device_queue_families;
     uint32_t queue_family_indices[] = {indices.graphics_family.value(), indices.present_family.value()};
 
     if (indices.graphics_family != indices.present_family)
@@ -464,7 +1264,7 @@ void create_swap_chain()
     create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     create_info.presentMode = present_mode;
     create_info.clipped = VK_TRUE;
-    create_info.oldSwapchain = VK_NULL_HANDLE;
+    create_info.oldSwapchain = old_swap_chain;
 
     if (vkCreateSwapchainKHR(device, &create_info, nullptr, &swap_chain) != VK_SUCCESS)
     {
@@ -476,9 +1276,117 @@ void create_swap_chain()
     swap_chain_images.resize(swap_chain_image_count);
     vkGetSwapchainImagesKHR(device, swap_chain, &swap_chain_image_count, swap_chain_images.data());
 
+    // None of the new images are in use by a frame yet.
+    image_frame_values.assign(swap_chain_image_count, 0);
+
     // Store data for future use
-    swap_chain_image_format = surface_format.format;
     swap_chain_extent = extent;
+    swap_chain_present_mode = present_mode;
+}
+
+VkFormat choose_offscreen_format()
+{
+    // Same preference as choose_swap_surface_format(), with fallbacks for drivers without BGRA attachments.
+    const VkFormat candidates[] = {
+        VK_FORMAT_B8G8R8A8_SRGB,
+        VK_FORMAT_R8G8B8A8_SRGB,
+        VK_FORMAT_B8G8R8A8_UNORM,
+        VK_FORMAT_R8G8B8A8_UNORM
+    };
+
+    for (VkFormat format : candidates)
+    {
+        VkFormatProperties format_properties;
+        vkGetPhysicalDeviceFormatProperties(physical_device, format, &format_properties);
+
+        if (format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)
+        {
+            return format;
+        }
+    }
+
+    throw std::runtime_error("Failed to find a supported offscreen color format!");
+}
+
+// Picked once, before the swap chain exists, so the pipeline can be built while the swap chain is being created.
+void choose_color_format()
+{
+    if (headless)
+    {
+        swap_chain_image_format = choose_offscreen_format();
+        return;
+    }
+
+    swap_chain_surface_format = choose_swap_surface_format(device_swap_chain_support.formats);
+    swap_chain_image_format = swap_chain_surface_format.format;
+}
+
+// Also picked once with the device. D32 is preferred, reverse-Z needs the float precision.
+void choose_depth_format()
+{
+    const VkFormat candidates[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_X8_D24_UNORM_PACK32
+    };
+
+    for (VkFormat format : candidates)
+    {
+        VkFormatProperties format_properties;
+        vkGetPhysicalDeviceFormatProperties(physical_device, format, &format_properties);
+
+        if (format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+        {
+            if (format == VK_FORMAT_X8_D24_UNORM_PACK32) std::cout << "D32 depth is not supported, reverse-Z loses precision with D24." << std::endl;
+
+            depth_format = format;
+            return;
+        }
+    }
+
+    throw std::runtime_error("Failed to find a supported depth format!");
+}
+
+VkImageAspectFlags depth_aspect_flags()
+{
+    if (depth_format == VK_FORMAT_D32_SFLOAT_S8_UINT) return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    return VK_IMAGE_ASPECT_DEPTH_BIT;
+}
+
+// Headless replacement for create_swap_chain(). Creates a ring of images (one per frame in flight by default)
+// and stores them in swap_chain_images so the image views and framebuffers can be created as usual.
+void create_offscreen_targets(VkExtent2D extent = {WIDTH, HEIGHT})
+{
+    swap_chain_extent = extent;
+
+    uint32_t image_count = requested_swap_chain_image_count != 0 ? requested_swap_chain_image_count : max_frames_in_flight;
+
+    swap_chain_images.resize(image_count);
+    offscreen_image_memory.resize(image_count);
+    image_frame_values.assign(image_count, 0);
+
+    for (size_t i = 0; i < swap_chain_images.size(); i++)
+    {
+        VkImageCreateInfo image_info {};
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.format = swap_chain_image_format;
+        image_info.extent = {swap_chain_extent.width, swap_chain_extent.height, 1};
+        image_info.mipLevels = 1;
+        image_info.arrayLayers = 1;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT; // Transfer source allows reading results back
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        if (vkCreateImage(device, &image_info, nullptr, &swap_chain_images[i]) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create offscreen image!");
+        }
+
+        offscreen_image_memory[i] = em_memory::allocate_image(swap_chain_images[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
 }
 
 void create_image_views()
@@ -511,16 +1419,197 @@ void create_image_views()
     }
 }
 
+RenderTarget create_render_target(VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect)
+{
+    RenderTarget target {};
+
+    VkImageCreateInfo image_info {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = format;
+    image_info.extent = {swap_chain_extent.width, swap_chain_extent.height, 1};
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = msaa_samples;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (vkCreateImage(device, &image_info, nullptr, &target.image) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create render target image!");
+    }
+
+    target.memory = em_memory::allocate_transient_image(target.image, &render_targets_lazily_allocated);
+
+    VkImageViewCreateInfo view_info {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = target.image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = format;
+    view_info.subresourceRange.aspectMask = aspect;
+    view_info.subresourceRange.baseMipLevel = 0;
+    view_info.subresourceRange.levelCount = 1;
+    view_info.subresourceRange.baseArrayLayer = 0;
+    view_info.subresourceRange.layerCount = 1;
+
+    if (vkCreateImageView(device, &view_info, nullptr, &target.view) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create render target image view!");
+    }
+
+    return target;
+}
+
+// Needs the swap chain extent and image count, so they're created along with the image views.
+void create_render_targets()
+{
+    depth_targets.resize(swap_chain_images.size());
+    msaa_color_targets.resize(msaa_samples != VK_SAMPLE_COUNT_1_BIT ? swap_chain_images.size() : 0);
+
+    for (size_t i = 0; i < swap_chain_images.size(); i++)
+    {
+        depth_targets[i] = create_render_target(depth_format, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, depth_aspect_flags());
+        render_target_bytes = depth_targets[i].memory.size;
+
+        if (!msaa_color_targets.empty())
+        {
+            msaa_color_targets[i] = create_render_target(swap_chain_image_format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+            render_target_bytes += msaa_color_targets[i].memory.size;
+        }
+    }
+}
+
 /* #endregion */
 
 /* #region Graphics Pipeline */
 
-VkShaderModule create_shader_module(const std::vector<char>& code)
+// Checks if cache data written by a previous launch was created by the same driver and device.
+bool is_pipeline_cache_valid(const std::vector<char>& cache_data)
+{
+    if (cache_data.size() < sizeof(VkPipelineCacheHeaderVersionOne)) return false;
+
+    VkPipelineCacheHeaderVersionOne header;
+    memcpy(&header, cache_data.data(), sizeof(header));
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(physical_device, &device_properties);
+
+    return header.headerSize >= sizeof(VkPipelineCacheHeaderVersionOne) &&
+        header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header.vendorID == device_properties.vendorID &&
+        header.deviceID == device_properties.deviceID &&
+        memcmp(header.pipelineCacheUUID, device_properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void create_pipeline_cache()
+{
+    std::vector<char> cache_data;
+
+    if (em_util::file_exists(pipeline_cache_path))
+    {
+        cache_data = em_util::read_file(pipeline_cache_path);
+
+        if (!is_pipeline_cache_valid(cache_data))
+        {
+            std::cout << "Discarding stale pipeline cache " << pipeline_cache_path << std::endl;
+            cache_data.clear();
+        }
+    }
+
+    pipeline_cache_warm = !cache_data.empty();
+
+    VkPipelineCacheCreateInfo cache_info {};
+    cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cache_info.initialDataSize = cache_data.size();
+    cache_info.pInitialData = cache_data.empty() ? nullptr : cache_data.data();
+
+    if (vkCreatePipelineCache(device, &cache_info, nullptr, &pipeline_cache) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create pipeline cache!");
+    }
+}
+
+void save_pipeline_cache()
+{
+    size_t cache_size = 0;
+    vkGetPipelineCacheData(device, pipeline_cache, &cache_size, nullptr);
+
+    std::vector<char> cache_data(cache_size);
+    if (vkGetPipelineCacheData(device, pipeline_cache, &cache_size, cache_data.data()) != VK_SUCCESS)
+    {
+        std::cout << "Failed to retrieve pipeline cache data, cache not saved." << std::endl;
+        return;
+    }
+
+    cache_data.resize(cache_size);
+    em_util::write_file(pipeline_cache_path, cache_data);
+}
+
+// Loads shaders/<name>.spv, or uses the copy embedded in the binary when built with EM_EMBED_SHADERS.
+em_util::SpirvCode load_shader_code(const std::string& name)
+{
+    {
+        std::lock_guard<std::mutex> lock(preloaded_shader_mutex);
+
+        std::map<std::string, em_util::SpirvCode>::iterator preloaded = preloaded_shader_code.find(name);
+        if (preloaded != preloaded_shader_code.end())
+        {
+            em_util::SpirvCode code = preloaded->second;
+            preloaded_shader_code.erase(preloaded);
+            return code;
+        }
+    }
+
+#ifdef EM_EMBED_SHADERS
+    if (name == "vert") return em_util::wrap_spirv_code(em_embedded_shaders::vert_spv, sizeof(em_embedded_shaders::vert_spv));
+    if (name == "frag") return em_util::wrap_spirv_code(em_embedded_shaders::frag_spv, sizeof(em_embedded_shaders::frag_spv));
+    if (name == "cull") return em_util::wrap_spirv_code(em_embedded_shaders::cull_spv, sizeof(em_embedded_shaders::cull_spv));
+#endif
+
+    return em_util::map_spirv_file("shaders/" + name + ".spv");
+}
+
+// Loads the shaders the startup pipelines will need, while the device doesn't exist yet.
+void preload_shader_code()
+{
+    std::vector<std::string> names = {"vert", "frag"};
+    if (gpu_driven_rendering || run_cull_benchmark) names.push_back("cull");
+
+    for (const std::string& name : names)
+    {
+        std::chrono::steady_clock::time_point load_start_time = std::chrono::steady_clock::now();
+        em_util::SpirvCode code = load_shader_code(name);
+
+        if (name != "cull")
+        {
+            std::chrono::duration<double, std::milli> load_elapsed = std::chrono::steady_clock::now() - load_start_time;
+            graphics_shader_preload_ms += load_elapsed.count();
+        }
+
+        std::lock_guard<std::mutex> lock(preloaded_shader_mutex);
+        preloaded_shader_code[name] = code;
+    }
+}
+
+// Releases what the startup didn't use (e.g. the cull shader on devices without drawIndirectCount).
+void release_preloaded_shader_code()
+{
+    for (std::pair<const std::string, em_util::SpirvCode>& entry : preloaded_shader_code)
+    {
+        em_util::release_spirv_code(entry.second);
+    }
+
+    preloaded_shader_code.clear();
+}
+
+VkShaderModule create_shader_module(const em_util::SpirvCode& code)
 {
     VkShaderModuleCreateInfo create_info {};
     create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = code.size();
-    create_info.pCode = reinterpret_cast<const uint32_t*>(code.data());
+    create_info.codeSize = code.size;
+    create_info.pCode = code.code;
 
     VkShaderModule shader_module;
     if (vkCreateShaderModule(device, &create_info, nullptr, &shader_module) != VK_SUCCESS) {
@@ -530,14 +1619,33 @@ VkShaderModule create_shader_module(const std::vector<char>& code)
     return shader_module;
 }
 
-void create_graphics_pipeline()
+struct PipelineBuildTimings
 {
-    std::vector<char> vert_shader_code = em_util::read_file("shaders/vert.spv");
-    std::vector<char> frag_shader_code = em_util::read_file("shaders/frag.spv");
+    double shader_load_ms; // Loading the SPIR-V and creating the shader modules
+    double create_ms;
+};
+
+// Of the startup pipeline, recorded as metrics on the main thread once the startup tasks are done.
+PipelineBuildTimings startup_pipeline_timings {};
+
+// Builds a graphics pipeline from the current shaders. Only touches the device and immutable state, so
+// it can run on a background thread while frames are being rendered.
+VkPipeline build_graphics_pipeline(PipelineBuildTimings* timings = nullptr)
+{
+    std::chrono::steady_clock::time_point load_start_time = std::chrono::steady_clock::now();
+
+    em_util::SpirvCode vert_shader_code = load_shader_code("vert");
+    em_util::SpirvCode frag_shader_code = load_shader_code("frag");
 
     VkShaderModule vert_shader_module = create_shader_module(vert_shader_code);
     VkShaderModule frag_shader_module = create_shader_module(frag_shader_code);
 
+    std::chrono::duration<double, std::milli> load_elapsed = std::chrono::steady_clock::now() - load_start_time;
+
+    // The code is copied into the shader modules, the file mappings aren't needed anymore.
+    em_util::release_spirv_code(vert_shader_code);
+    em_util::release_spirv_code(frag_shader_code);
+
     // Make shader stages
     VkPipelineShaderStageCreateInfo vert_shader_stage_info{};
     vert_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -565,12 +1673,18 @@ void create_graphics_pipeline()
     dynamic_state_info.pDynamicStates = dynamic_states.data();
 
     // Vertex input
+    VkVertexInputBindingDescription binding_descriptions[] = {
+        Vertex::get_binding_description(),
+        InstanceData::get_binding_description()
+    };
+    std::array<VkVertexInputAttributeDescription, 6> attribute_descriptions = get_attribute_descriptions();
+
     VkPipelineVertexInputStateCreateInfo vertex_input_info{};
     vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_info.vertexBindingDescriptionCount = 0;
-    vertex_input_info.pVertexBindingDescriptions = nullptr; // Optional
-    vertex_input_info.vertexAttributeDescriptionCount = 0;
-    vertex_input_info.pVertexAttributeDescriptions = nullptr; // Optional
+    vertex_input_info.vertexBindingDescriptionCount = 2;
+    vertex_input_info.pVertexBindingDescriptions = binding_descriptions;
+    vertex_input_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(attribute_descriptions.size());
+    vertex_input_info.pVertexAttributeDescriptions = attribute_descriptions.data();
 
     // Input assembly
     VkPipelineInputAssemblyStateCreateInfo input_assembly_info{};
@@ -602,7 +1716,7 @@ void create_graphics_pipeline()
     VkPipelineMultisampleStateCreateInfo multisampling_info{};
     multisampling_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
     multisampling_info.sampleShadingEnable = VK_FALSE;
-    multisampling_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisampling_info.rasterizationSamples = msaa_samples;
     multisampling_info.minSampleShading = 1.0f; // Optional
     multisampling_info.pSampleMask = nullptr; // Optional
     multisampling_info.alphaToCoverageEnable = VK_FALSE; // Optional
@@ -630,17 +1744,14 @@ void create_graphics_pipeline()
     color_blending_info.blendConstants[2] = 0.0f; // Optional
     color_blending_info.blendConstants[3] = 0.0f; // Optional
 
-    // Pipeline Layout
-    VkPipelineLayoutCreateInfo pipeline_layout_info{};
-    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipeline_layout_info.setLayoutCount = 0; // Optional
-    pipeline_layout_info.pSetLayouts = nullptr; // Optional
-    pipeline_layout_info.pushConstantRangeCount = 0; // Optional
-    pipeline_layout_info.pPushConstantRanges = nullptr; // Optional
-
-    if (vkCreatePipelineLayout(device, &pipeline_layout_info, nullptr, &pipeline_layout) != VK_SUCCESS) {
-        throw std::runtime_error("Failed to create pipeline layout!");
-    } 
+    // Depth testing (reverse-Z, nearer fragments have a larger depth)
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_info {};
+    depth_stencil_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_info.depthTestEnable = depth_test;
+    depth_stencil_info.depthWriteEnable = depth_test;
+    depth_stencil_info.depthCompareOp = VK_COMPARE_OP_GREATER;
+    depth_stencil_info.depthBoundsTestEnable = VK_FALSE;
+    depth_stencil_info.stencilTestEnable = VK_FALSE;
 
     // Create the graphics pipeline
     VkGraphicsPipelineCreateInfo pipeline_info {};
@@ -656,385 +1767,2252 @@ void create_graphics_pipeline()
     pipeline_info.pViewportState = &viewport_state_info;
     pipeline_info.pRasterizationState = &rasterizer_info;
     pipeline_info.pMultisampleState = &multisampling_info;
-    pipeline_info.pDepthStencilState = nullptr; // Optional
+    pipeline_info.pDepthStencilState = &depth_stencil_info;
     pipeline_info.pColorBlendState = &color_blending_info;
     pipeline_info.pDynamicState = &dynamic_state_info;
 
     pipeline_info.layout = pipeline_layout;
 
-    pipeline_info.renderPass = render_pass;
+    // Without a render pass the attachment formats are given to the pipeline directly.
+    VkPipelineRenderingCreateInfo rendering_info {};
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachmentFormats = &swap_chain_image_format;
+    rendering_info.depthAttachmentFormat = depth_format;
+
+    if (use_dynamic_rendering) pipeline_info.pNext = &rendering_info;
+
+    pipeline_info.renderPass = use_dynamic_rendering ? VK_NULL_HANDLE : render_pass;
     pipeline_info.subpass = 0;
 
     pipeline_info.basePipelineHandle = VK_NULL_HANDLE; // Optional
     pipeline_info.basePipelineIndex = -1; // Optional
 
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &graphics_pipeline) != VK_SUCCESS) {
-        throw std::runtime_error("Failed to create graphics pipeline!");
-    }
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    VkPipeline pipeline;
+    VkResult result = vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_info, nullptr, &pipeline);
 
     // Cleanup after creation of pipeline
     vkDestroyShaderModule(device, frag_shader_module, nullptr);
     vkDestroyShaderModule(device, vert_shader_module, nullptr);
+
+    if (result != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create graphics pipeline!");
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cout << "Graphics pipeline created in " << elapsed.count() << " ms ("
+        << (pipeline_cache_warm ? "warm" : "cold") << " pipeline cache)" << std::endl;
+
+    if (timings != nullptr)
+    {
+        timings->create_ms = elapsed.count();
+        timings->shader_load_ms = load_elapsed.count();
+    }
+
+    return pipeline;
 }
 
-void create_render_pass()
+void create_descriptor_set_layout()
 {
-    VkAttachmentDescription color_attachment {};
-    color_attachment.format = swap_chain_image_format;
-    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    VkDescriptorSetLayoutBinding uniforms_binding {};
+    uniforms_binding.binding = 0;
+    uniforms_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    uniforms_binding.descriptorCount = 1;
+    uniforms_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layout_info {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 1;
+    layout_info.pBindings = &uniforms_binding;
+
+    if (vkCreateDescriptorSetLayout(device, &layout_info, nullptr, &descriptor_set_layout) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create descriptor set layout!");
+    }
+}
 
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+void create_pipeline_layout()
+{
+    create_descriptor_set_layout();
 
-    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    VkPushConstantRange push_constant_range {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(FrameConstants);
 
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkPipelineLayoutCreateInfo pipeline_layout_info{};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &descriptor_set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
 
-    VkAttachmentReference color_attachment_ref{};
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    if (vkCreatePipelineLayout(device, &pipeline_layout_info, nullptr, &pipeline_layout) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create pipeline layout!");
+    } 
+}
 
-    VkSubpassDescription subpass{};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_attachment_ref;
+void create_graphics_pipeline()
+{
+    create_pipeline_layout();
 
-    VkSubpassDependency dependency{};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    graphics_pipeline = build_graphics_pipeline(&startup_pipeline_timings);
 
-    VkRenderPassCreateInfo render_pass_info {};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = 1;
-    render_pass_info.pAttachments = &color_attachment;
-    render_pass_info.subpassCount = 1;
-    render_pass_info.pSubpasses = &subpass;
-    render_pass_info.dependencyCount = 1;
-    render_pass_info.pDependencies = &dependency;
+    // The SPIR-V was read by the preload task, which finished before this one started.
+    startup_pipeline_timings.shader_load_ms += graphics_shader_preload_ms;
+}
 
-    if (vkCreateRenderPass(device, &render_pass_info, nullptr, &render_pass) != VK_SUCCESS) {
-        throw std::runtime_error("Failed to create render pass!");
+void create_cull_pipeline()
+{
+    std::array<VkDescriptorSetLayoutBinding, 4> bindings {};
+    for (uint32_t i = 0; i < bindings.size(); i++)
+    {
+        // Objects, draw commands, draw count and the animated draw uniforms in the frame ring buffer
+        bindings[i].binding = i;
+        bindings[i].descriptorType = i == 3 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     }
-}
 
-/* #endregion */
+    VkDescriptorSetLayoutCreateInfo layout_info {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = static_cast<uint32_t>(bindings.size());
+    layout_info.pBindings = bindings.data();
 
-/* #region Framebuffers */
+    if (vkCreateDescriptorSetLayout(device, &layout_info, nullptr, &cull_descriptor_set_layout) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create cull descriptor set layout!");
+    }
 
-void create_framebuffers()
-{
-    swap_chain_framebuffers.resize(swap_chain_image_views.size());
+    VkPushConstantRange push_constant_range {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(CullConstants);
 
-    for (size_t i = 0; i < swap_chain_image_views.size(); i++)
+    VkPipelineLayoutCreateInfo pipeline_layout_info {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &cull_descriptor_set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(device, &pipeline_layout_info, nullptr, &cull_pipeline_layout) != VK_SUCCESS)
     {
-        VkImageView attachments[] = {
-            swap_chain_image_views[i]
-        };
+        throw std::runtime_error("Failed to create cull pipeline layout!");
+    }
 
-        VkFramebufferCreateInfo framebuffer_info {};
-        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebuffer_info.renderPass = render_pass;
-        framebuffer_info.attachmentCount = 1;
-        framebuffer_info.pAttachments = attachments;
-        framebuffer_info.width = swap_chain_extent.width;
-        framebuffer_info.height = swap_chain_extent.height;
-        framebuffer_info.layers = 1;
+    em_util::SpirvCode cull_shader_code = load_shader_code("cull");
+    VkShaderModule cull_shader_module = create_shader_module(cull_shader_code);
+    em_util::release_spirv_code(cull_shader_code);
 
-        if (vkCreateFramebuffer(device, &framebuffer_info, nullptr, &swap_chain_framebuffers[i]) != VK_SUCCESS)
-        {
-            throw std::runtime_error("Failed to create framebuffer!");
-        }
+    VkComputePipelineCreateInfo pipeline_info {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = cull_shader_module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = cull_pipeline_layout;
+
+    VkResult result = vkCreateComputePipelines(device, pipeline_cache, 1, &pipeline_info, nullptr, &cull_pipeline);
+    vkDestroyShaderModule(device, cull_shader_module, nullptr);
+
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create cull pipeline!");
     }
 }
 
-/* #endregion */
+// Reads how many submitted frames have finished (frames complete in submission order) into completed_frames.
+// Called once per frame, everything else uses completed_frames. Never blocks.
+void update_completed_frames()
+{
+    if (!use_timeline_semaphores) return;
 
-/* #region Command Pools */
+    uint64_t value = 0;
+    vkGetSemaphoreCounterValue(device, frame_timeline, &value);
+    completed_frames = std::max(completed_frames, value);
+}
 
-void record_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index)
+// Blocks until the frame with the given value has finished. Returns right away if it's known to be finished.
+void wait_for_frame(uint64_t value)
 {
-    VkCommandBufferBeginInfo begin_info{};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = 0; // Optional
-    begin_info.pInheritanceInfo = nullptr; // Optional
+    if (value <= completed_frames) return;
 
-    if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
+    if (use_timeline_semaphores)
     {
-        throw std::runtime_error("Failed to begin recording command buffer!");
+        VkSemaphoreWaitInfo wait_info {};
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &frame_timeline;
+        wait_info.pValues = &value;
+
+        vkWaitSemaphores(device, &wait_info, UINT64_MAX);
+    }
+    else
+    {
+        // Frame slots are used round robin and a slot is only reused after its frame finished,
+        // so the fence of the slot still belongs to this frame (or to nothing newer).
+        vkWaitForFences(device, 1, &in_flight_fences[(value - 1) % max_frames_in_flight], VK_TRUE, UINT64_MAX);
     }
 
-    // Start render pass
-    VkRenderPassBeginInfo render_pass_info {};
+    completed_frames = std::max(completed_frames, value);
+}
+
+/* #region Shader Hot Reload */
+
+// Builds the shaders target of the build the executable came from, which only recompiles the changed GLSL sources.
+// Only available when the build compiles the shaders (it then defines where the sources and the build are).
+bool compile_shader_sources()
+{
+#ifdef EM_SHADER_SOURCE_DIR
+    std::string command = std::string("\"") + EM_CMAKE_COMMAND + "\" --build \"" + EM_BINARY_DIR + "\" --target shaders";
+    return std::system(command.c_str()) == 0;
+#else
+    return false;
+#endif
+}
+
+// Starts rebuilding the pipeline on a background thread, unless a rebuild is already running.
+void start_pipeline_rebuild(bool compile_sources)
+{
+    if (pipeline_rebuild_running)
+    {
+        // Pick up the newest shaders once the current rebuild is done.
+        pipeline_rebuild_requested = true;
+        shader_compile_requested = shader_compile_requested || compile_sources;
+        return;
+    }
+
+    if (pipeline_rebuild_thread.joinable()) pipeline_rebuild_thread.join();
+
+    pipeline_rebuild_running = true;
+    pipeline_rebuild_compiles = compile_sources;
+    pipeline_rebuild_requested = false;
+    shader_compile_requested = false;
+
+    pipeline_rebuild_thread = std::thread([compile_sources]() {
+        try
+        {
+            if (compile_sources && !compile_shader_sources())
+            {
+                throw std::runtime_error("Failed to compile the shaders!");
+            }
+
+            // Replaces a pipeline that was finished but never swapped in.
+            VkPipeline unused_pipeline = rebuilt_pipeline.exchange(build_graphics_pipeline());
+            if (unused_pipeline != VK_NULL_HANDLE) vkDestroyPipeline(device, unused_pipeline, nullptr);
+        }
+        catch (const std::exception& error)
+        {
+            std::cout << "Shader reload failed, keeping the old pipeline: " << error.what() << std::endl;
+        }
+
+        pipeline_rebuild_running = false;
+    });
+}
+
+// Called once per frame from the main loop, never blocks.
+void poll_shader_reload()
+{
+    em_shader_watcher::Changes changes = em_shader_watcher::poll_changes();
+
+#ifndef EM_SHADER_SOURCE_DIR
+    // Without a shader compiler in the build the sources can't be recompiled (the shaders directory may be a link to them).
+    changes.sources = false;
+#endif
+
+    // The SPIR-V written while recompiling the sources is loaded by that same rebuild.
+    bool spirv_changed = changes.spirv && !(pipeline_rebuild_running && pipeline_rebuild_compiles);
+
+    if (changes.sources || spirv_changed || (pipeline_rebuild_requested && !pipeline_rebuild_running))
+    {
+        start_pipeline_rebuild(changes.sources || shader_compile_requested);
+    }
+}
+
+// Swaps in a rebuilt pipeline at the start of a frame. The old pipeline might still be used by frames
+// in flight, so it's only destroyed once those frames have finished.
+void swap_rebuilt_pipeline()
+{
+    while (!retired_pipelines.empty() && retired_pipelines.front().last_frame <= completed_frames)
+    {
+        vkDestroyPipeline(device, retired_pipelines.front().pipeline, nullptr);
+        retired_pipelines.pop_front();
+    }
+
+    VkPipeline pipeline = rebuilt_pipeline.exchange(VK_NULL_HANDLE);
+    if (pipeline == VK_NULL_HANDLE) return;
+
+    // The old pipeline was used by all frames submitted so far.
+    retired_pipelines.push_back({graphics_pipeline, submitted_frame_count});
+    graphics_pipeline = pipeline;
+
+    std::cout << "Shaders reloaded." << std::endl;
+}
+
+void cleanup_shader_reload()
+{
+    em_shader_watcher::stop();
+    if (pipeline_rebuild_thread.joinable()) pipeline_rebuild_thread.join();
+
+    // The device is idle at this point.
+    VkPipeline pipeline = rebuilt_pipeline.exchange(VK_NULL_HANDLE);
+    if (pipeline != VK_NULL_HANDLE) vkDestroyPipeline(device, pipeline, nullptr);
+
+    for (RetiredPipeline& retired_pipeline : retired_pipelines)
+    {
+        vkDestroyPipeline(device, retired_pipeline.pipeline, nullptr);
+    }
+    retired_pipelines.clear();
+}
+
+/* #endregion */
+
+// Attachment 0 is rendered into and 1 is the depth buffer. With MSAA, 0 is the multisampled color target and it is
+// resolved into the swap chain image (attachment 2) at the end of the subpass, so the samples never leave the tile.
+void create_render_pass()
+{
+    bool multisampled = msaa_samples != VK_SAMPLE_COUNT_1_BIT;
+
+    VkAttachmentDescription color_attachment {};
+    color_attachment.format = swap_chain_image_format;
+    color_attachment.samples = msaa_samples;
+
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = multisampled ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+
+    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // PRESENT_SRC_KHR requires the swap chain extension, offscreen targets are left ready for a readback instead.
+    VkImageLayout output_layout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    color_attachment.finalLayout = multisampled ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : output_layout;
+
+    VkAttachmentReference color_attachment_ref{};
+    color_attachment_ref.attachment = 0;
+    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription resolve_attachment {};
+    resolve_attachment.format = swap_chain_image_format;
+    resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resolve_attachment.finalLayout = output_layout;
+
+    VkAttachmentReference resolve_attachment_ref{};
+    resolve_attachment_ref.attachment = 2;
+    resolve_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    // Depth is only needed during the pass, so it's never stored.
+    VkAttachmentDescription depth_attachment {};
+    depth_attachment.format = depth_format;
+    depth_attachment.samples = msaa_samples;
+
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference depth_attachment_ref{};
+    depth_attachment_ref.attachment = 1;
+    depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &color_attachment_ref;
+    subpass.pDepthStencilAttachment = &depth_attachment_ref;
+    if (multisampled) subpass.pResolveAttachments = &resolve_attachment_ref;
+
+    // The depth clear has to wait for the depth writes of the previous frame rendering into the same image.
+    VkSubpassDependency dependency{};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    VkAttachmentDescription attachments[] = {color_attachment, depth_attachment, resolve_attachment};
+
+    VkRenderPassCreateInfo render_pass_info {};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_info.attachmentCount = multisampled ? 3 : 2;
+    render_pass_info.pAttachments = attachments;
+    render_pass_info.subpassCount = 1;
+    render_pass_info.pSubpasses = &subpass;
+    render_pass_info.dependencyCount = 1;
+    render_pass_info.pDependencies = &dependency;
+
+    if (vkCreateRenderPass(device, &render_pass_info, nullptr, &render_pass) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create render pass!");
+    }
+}
+
+/* #endregion */
+
+/* #region Framebuffers */
+
+void create_framebuffers()
+{
+    // Dynamic rendering renders into the image views directly.
+    if (render_pass == VK_NULL_HANDLE) return;
+
+    swap_chain_framebuffers.resize(swap_chain_image_views.size());
+
+    for (size_t i = 0; i < swap_chain_image_views.size(); i++)
+    {
+        // Same order as the attachments of the render pass
+        std::array<VkImageView, 3> attachments;
+        uint32_t attachment_count;
+        if (msaa_color_targets.empty())
+        {
+            attachments = {swap_chain_image_views[i], depth_targets[i].view, VK_NULL_HANDLE};
+            attachment_count = 2;
+        }
+        else
+        {
+            attachments = {msaa_color_targets[i].view, depth_targets[i].view, swap_chain_image_views[i]};
+            attachment_count = 3;
+        }
+
+        VkFramebufferCreateInfo framebuffer_info {};
+        framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebuffer_info.renderPass = render_pass;
+        framebuffer_info.attachmentCount = attachment_count;
+        framebuffer_info.pAttachments = attachments.data();
+        framebuffer_info.width = swap_chain_extent.width;
+        framebuffer_info.height = swap_chain_extent.height;
+        framebuffer_info.layers = 1;
+
+        if (vkCreateFramebuffer(device, &framebuffer_info, nullptr, &swap_chain_framebuffers[i]) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create framebuffer!");
+        }
+    }
+}
+
+/* #endregion */
+
+/* #region Command Pools */
+
+// Binds the state shared by all draw calls.
+void cmd_bind_draw_state(VkCommandBuffer command_buffer)
+{
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
+
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = static_cast<float>(swap_chain_extent.width);
+    viewport.height = static_cast<float>(swap_chain_extent.height);
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.offset = {0, 0};
+    scissor.extent = swap_chain_extent;
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+    VkBuffer vertex_buffers[] = {vertex_buffer, instance_buffer};
+    VkDeviceSize offsets[] = {0, 0};
+    vkCmdBindVertexBuffers(command_buffer, 0, 2, vertex_buffers, offsets);
+
+    FrameConstants frame_constants {};
+    frame_constants.time = frame_time;
+    frame_constants.zoom = view_zoom;
+    vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(frame_constants), &frame_constants);
+}
+
+// Same as animate_draw() in cull.comp
+DrawUniforms animated_draw_uniforms(uint32_t draw)
+{
+    DrawUniforms uniforms = {{1.0f, 1.0f, 1.0f, 1.0f}, 0.0f, {}};
+    uniforms.rotation = frame_time * (0.5f + 0.25f * (draw % 4));
+    uniforms.tint[0] = 0.75f + 0.25f * std::sin(frame_time + draw);
+    uniforms.tint[1] = 0.75f + 0.25f * std::cos(frame_time + draw);
+
+    return uniforms;
+}
+
+// Reserves this frame's animated uniforms in the frame ring buffer. The CPU path writes them right away, with
+// --gpu-driven the culling shader writes them, so the CPU never loops over the objects.
+void allocate_animated_draw_uniforms()
+{
+    em_frame_ring::Slice slice = em_frame_ring::allocate(sizeof(DrawUniforms) * draw_call_count);
+    draw_uniforms_offset = slice.offset;
+
+    if (gpu_driven_rendering) return;
+
+    DrawUniforms* uniforms = static_cast<DrawUniforms*>(slice.data);
+    for (uint32_t draw = 0; draw < draw_call_count; draw++)
+    {
+        uniforms[draw] = animated_draw_uniforms(draw);
+    }
+}
+
+// Binds the uniforms of all draw calls, every instance picks its draw call's entry.
+void cmd_bind_draw_uniforms(VkCommandBuffer command_buffer)
+{
+    if (animate)
+    {
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &draw_uniforms_descriptor_set, 1, &draw_uniforms_offset);
+    }
+    else
+    {
+        uint32_t dynamic_offset = 0;
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &static_draw_uniforms_descriptor_set, 1, &dynamic_offset);
+    }
+}
+
+// Same test as cull.comp
+bool is_object_visible(const ObjectData& object)
+{
+    return object.bounds_min[0] * view_zoom <= 1.0f && object.bounds_min[1] * view_zoom <= 1.0f
+        && object.bounds_max[0] * view_zoom >= -1.0f && object.bounds_max[1] * view_zoom >= -1.0f;
+}
+
+// Records the visible draw calls in [first_draw, end_draw) of the draw order, including all state they need.
+void record_draws(VkCommandBuffer command_buffer, uint32_t first_draw, uint32_t end_draw)
+{
+    cmd_bind_draw_state(command_buffer);
+    cmd_bind_draw_uniforms(command_buffer);
+
+    for (uint32_t i = first_draw; i < end_draw; i++)
+    {
+        uint32_t draw = draw_order[i];
+        const ObjectData& object = objects[draw];
+        if (!is_object_visible(object)) continue;
+
+        vkCmdDraw(command_buffer, static_cast<uint32_t>(vertices.size()), object.instance_count, 0, object.first_instance);
+    }
+}
+
+// Culls the objects on the GPU and writes the indirect draws of this frame slot. Must be recorded outside of the render pass.
+void cmd_cull_objects(VkCommandBuffer command_buffer)
+{
+    VkBuffer indirect_buffer = indirect_buffers[current_frame];
+    vkCmdFillBuffer(command_buffer, indirect_buffer, 0, sizeof(uint32_t), 0);
+
+    VkMemoryBarrier clear_barrier {};
+    clear_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    clear_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    clear_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+        1, &clear_barrier, 0, nullptr, 0, nullptr);
+
+    CullConstants cull_constants {};
+    cull_constants.zoom = view_zoom;
+    cull_constants.object_count = static_cast<uint32_t>(objects.size());
+    cull_constants.vertex_count = static_cast<uint32_t>(vertices.size());
+    cull_constants.time = frame_time;
+    cull_constants.animate = animate ? 1 : 0;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline_layout, 0, 1, &cull_descriptor_sets[current_frame], 1, &draw_uniforms_offset);
+    vkCmdPushConstants(command_buffer, cull_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cull_constants), &cull_constants);
+    vkCmdDispatch(command_buffer, (cull_constants.object_count + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1, 1);
+
+    // The draws read the commands, and the vertex shader the animated uniforms.
+    VkMemoryBarrier draw_barrier {};
+    draw_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    draw_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    draw_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0,
+        1, &draw_barrier, 0, nullptr, 0, nullptr);
+}
+
+// Draws whatever cmd_cull_objects left visible.
+void record_indirect_draws(VkCommandBuffer command_buffer)
+{
+    cmd_bind_draw_state(command_buffer);
+    cmd_bind_draw_uniforms(command_buffer);
+
+    VkBuffer indirect_buffer = indirect_buffers[current_frame];
+    vkCmdDrawIndirectCount(command_buffer, indirect_buffer, INDIRECT_COMMANDS_OFFSET, indirect_buffer, 0,
+        static_cast<uint32_t>(objects.size()), sizeof(VkDrawIndirectCommand));
+}
+
+// Called on a worker thread, records this thread's slice of the draw calls for the current frame.
+void record_secondary_command_buffer(uint32_t thread_index, uint32_t image_index)
+{
+    // The previous frame of this slot has finished, so everything allocated from the pool can be reset at once.
+    vkResetCommandPool(device, worker_command_pools[current_frame][thread_index], 0);
+    VkCommandBuffer command_buffer = worker_command_buffers[current_frame][thread_index];
+
+    VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info {};
+    inheritance_rendering_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+    inheritance_rendering_info.colorAttachmentCount = 1;
+    inheritance_rendering_info.pColorAttachmentFormats = &swap_chain_image_format;
+    inheritance_rendering_info.depthAttachmentFormat = depth_format;
+    inheritance_rendering_info.rasterizationSamples = msaa_samples;
+
+    VkCommandBufferInheritanceInfo inheritance_info {};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance_info.pipelineStatistics = em_profiler::pipeline_statistics_flags();
+
+    if (use_dynamic_rendering)
+    {
+        inheritance_info.pNext = &inheritance_rendering_info;
+    }
+    else
+    {
+        inheritance_info.renderPass = render_pass;
+        inheritance_info.subpass = 0;
+        inheritance_info.framebuffer = swap_chain_framebuffers[image_index];
+    }
+
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+
+    if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to begin recording secondary command buffer!");
+    }
+
+    uint32_t thread_count = em_workers::thread_count();
+    record_draws(command_buffer, draw_call_count * thread_index / thread_count, draw_call_count * (thread_index + 1) / thread_count);
+
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to record secondary command buffer!");
+    }
+}
+
+void cmd_transition_image_layout(VkCommandBuffer command_buffer, VkImage image, VkImageLayout old_layout, VkImageLayout new_layout,
+    VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access,
+    VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT)
+{
+    VkImageMemoryBarrier2 barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = src_stage;
+    barrier.srcAccessMask = src_access;
+    barrier.dstStageMask = dst_stage;
+    barrier.dstAccessMask = dst_access;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+
+    VkDependencyInfo dependency_info {};
+    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency_info.imageMemoryBarrierCount = 1;
+    dependency_info.pImageMemoryBarriers = &barrier;
+
+    vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+}
+
+// Does what the render pass does implicitly: the layout transitions and the external dependency.
+void cmd_begin_dynamic_rendering(VkCommandBuffer command_buffer, uint32_t image_index, VkRenderingFlags flags)
+{
+    // Waits for the acquire semaphore, which is signaled at the color attachment output stage.
+    cmd_transition_image_layout(command_buffer, swap_chain_images[image_index],
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+
+    // The contents are discarded, but the clear has to wait for the depth writes of the previous frame using the image.
+    cmd_transition_image_layout(command_buffer, depth_targets[image_index].image,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        depth_aspect_flags());
+
+    VkRenderingAttachmentInfo color_attachment {};
+    color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+    color_attachment.imageView = swap_chain_image_views[image_index];
+    color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.clearValue = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
+
+    // Renders into the multisampled target instead, which is resolved into the swap chain image and then discarded.
+    if (!msaa_color_targets.empty())
+    {
+        cmd_transition_image_layout(command_buffer, msaa_color_targets[image_index].image,
+            VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+
+        color_attachment.imageView = msaa_color_targets[image_index].view;
+        color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        color_attachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+        color_attachment.resolveImageView = swap_chain_image_views[image_index];
+        color_attachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    }
+
+    VkRenderingAttachmentInfo depth_attachment {};
+    depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+    depth_attachment.imageView = depth_targets[image_index].view;
+    depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.clearValue.depthStencil = {0.0f, 0}; // Reverse-Z far plane
+
+    VkRenderingInfo rendering_info {};
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    rendering_info.flags = flags;
+    rendering_info.renderArea.offset = {0, 0};
+    rendering_info.renderArea.extent = swap_chain_extent;
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &color_attachment;
+    rendering_info.pDepthAttachment = &depth_attachment;
+
+    vkCmdBeginRendering(command_buffer, &rendering_info);
+}
+
+void cmd_end_dynamic_rendering(VkCommandBuffer command_buffer, uint32_t image_index)
+{
+    vkCmdEndRendering(command_buffer);
+
+    // Offscreen targets are left ready for a readback, like the final layout of the render pass.
+    if (headless)
+    {
+        cmd_transition_image_layout(command_buffer, swap_chain_images[image_index],
+            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+    }
+    else
+    {
+        // The present waits on a semaphore, so no destination stage is needed.
+        cmd_transition_image_layout(command_buffer, swap_chain_images[image_index],
+            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE);
+    }
+}
+
+void record_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index)
+{
+    // The previous frame of this slot has finished, its part of the ring buffer can be overwritten.
+    em_frame_ring::begin_frame(current_frame);
+
+    if (animate)
+    {
+        frame_time = std::chrono::duration<float>(std::chrono::steady_clock::now() - animation_start_time).count();
+    }
+
+    if (animate) allocate_animated_draw_uniforms();
+
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = 0; // Optional
+    begin_info.pInheritanceInfo = nullptr; // Optional
+
+    if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to begin recording command buffer!");
+    }
+
+    // Start render pass
+    VkRenderPassBeginInfo render_pass_info {};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     render_pass_info.renderPass = render_pass;
-    render_pass_info.framebuffer = swap_chain_framebuffers[image_index];
+    render_pass_info.framebuffer = use_dynamic_rendering ? VK_NULL_HANDLE : swap_chain_framebuffers[image_index];
     render_pass_info.renderArea.offset = {0, 0};
     render_pass_info.renderArea.extent = swap_chain_extent;
 
-    VkClearValue clear_color = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    render_pass_info.clearValueCount = 1;
-    render_pass_info.pClearValues = &clear_color;
+    VkClearValue clear_values[2] {};
+    clear_values[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
+    clear_values[1].depthStencil = {0.0f, 0}; // Reverse-Z far plane
+    render_pass_info.clearValueCount = 2;
+    render_pass_info.pClearValues = clear_values;
+
+    // GPU timestamps have to be written outside of the render pass.
+    em_profiler::cmd_begin_gpu_timer(command_buffer, current_frame);
+
+    // Indirect draws are recorded inline, there's only one.
+    if (gpu_driven_rendering)
+    {
+        cmd_cull_objects(command_buffer);
+
+        if (use_dynamic_rendering) cmd_begin_dynamic_rendering(command_buffer, image_index, 0);
+        else vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+
+        record_indirect_draws(command_buffer);
+    }
+    else if (em_workers::thread_count() > 0)
+    {
+        // The draws are recorded in parallel, the primary command buffer only executes the results.
+        em_workers::run([image_index](uint32_t thread_index) {
+            record_secondary_command_buffer(thread_index, image_index);
+        });
+
+        if (use_dynamic_rendering) cmd_begin_dynamic_rendering(command_buffer, image_index, VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT);
+        else vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+        vkCmdExecuteCommands(command_buffer, em_workers::thread_count(), worker_command_buffers[current_frame].data());
+    }
+    else
+    {
+        if (use_dynamic_rendering) cmd_begin_dynamic_rendering(command_buffer, image_index, 0);
+        else vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+
+        record_draws(command_buffer, 0, draw_call_count);
+    }
+
+    if (use_dynamic_rendering) cmd_end_dynamic_rendering(command_buffer, image_index);
+    else vkCmdEndRenderPass(command_buffer);
+
+    em_profiler::cmd_end_gpu_timer(command_buffer);
+
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to record command buffer!");
+    }
+}
+
+void create_command_pool()
+{
+    const QueueFamilyIndices& queue_family_indices = device_queue_families;
+
+    VkCommandPoolCreateInfo pool_info {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_info.queueFamilyIndex = queue_family_indices.graphics_family.value();
+
+    if (vkCreateCommandPool(device, &pool_info, nullptr, &command_pool) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create command pool!");
+    }
+}
+
+void create_command_buffers()
+{
+    command_buffers.resize(max_frames_in_flight);
+
+    VkCommandBufferAllocateInfo alloc_info {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = (uint32_t) command_buffers.size();
+
+    if (vkAllocateCommandBuffers(device, &alloc_info, command_buffers.data()) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate command buffers!");
+    }
+}
+
+void create_worker_command_buffers()
+{
+    uint32_t thread_count = em_workers::thread_count();
+    const QueueFamilyIndices& queue_family_indices = device_queue_families;
+
+    worker_command_pools.assign(max_frames_in_flight, std::vector<VkCommandPool>(thread_count));
+    worker_command_buffers.assign(max_frames_in_flight, std::vector<VkCommandBuffer>(thread_count));
+
+    for (uint32_t frame = 0; frame < max_frames_in_flight; frame++)
+    {
+        for (uint32_t thread = 0; thread < thread_count; thread++)
+        {
+            // Command pools are not thread safe, so every thread needs its own.
+            VkCommandPoolCreateInfo pool_info {};
+            pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            pool_info.queueFamilyIndex = queue_family_indices.graphics_family.value();
+
+            if (vkCreateCommandPool(device, &pool_info, nullptr, &worker_command_pools[frame][thread]) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create worker command pool!");
+            }
+
+            VkCommandBufferAllocateInfo alloc_info {};
+            alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            alloc_info.commandPool = worker_command_pools[frame][thread];
+            alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            alloc_info.commandBufferCount = 1;
+
+            if (vkAllocateCommandBuffers(device, &alloc_info, &worker_command_buffers[frame][thread]) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to allocate secondary command buffers!");
+            }
+        }
+    }
+}
+
+void destroy_worker_command_buffers()
+{
+    for (std::vector<VkCommandPool>& frame_pools : worker_command_pools)
+    {
+        for (VkCommandPool pool : frame_pools)
+        {
+            vkDestroyCommandPool(device, pool, nullptr);
+        }
+    }
+
+    worker_command_pools.clear();
+    worker_command_buffers.clear();
+}
+
+/* #endregion */
+
+/* #region Buffers */
+
+void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, em_memory::Allocation& buffer_memory)
+{
+    VkBufferCreateInfo buffer_info {};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = usage;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (vkCreateBuffer(device, &buffer_info, nullptr, &buffer) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create buffer!");
+    }
+
+    buffer_memory = em_memory::allocate_buffer(buffer, properties);
+}
+
+void copy_buffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size)
+{
+    VkCommandBufferAllocateInfo alloc_info {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandPool = command_pool;
+    alloc_info.commandBufferCount = 1;
+
+    VkCommandBuffer command_buffer;
+    vkAllocateCommandBuffers(device, &alloc_info, &command_buffer);
+
+    VkCommandBufferBeginInfo begin_info {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkBeginCommandBuffer(command_buffer, &begin_info);
+
+    VkBufferCopy copy_region {};
+    copy_region.size = size;
+    vkCmdCopyBuffer(command_buffer, src_buffer, dst_buffer, 1, &copy_region);
+
+    vkEndCommandBuffer(command_buffer);
+
+    VkSubmitInfo submit_info {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &command_buffer;
+
+    vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
+    vkQueueWaitIdle(graphics_queue);
+
+    vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
+}
+
+// Creates a device local buffer and fills it through a host visible staging buffer. The stage and access flags
+// describe the first use of the buffer, asynchronous uploads are made visible to them.
+void create_device_local_buffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage,
+    VkPipelineStageFlags first_use_stage, VkAccessFlags first_use_access, VkBuffer& buffer, em_memory::Allocation& buffer_memory)
+{
+    if (use_timeline_semaphores)
+    {
+        create_buffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, buffer_memory);
+        em_upload::upload_buffer(buffer, 0, data, size, first_use_stage, first_use_access);
+        return;
+    }
+
+    VkBuffer staging_buffer;
+    em_memory::Allocation staging_buffer_memory;
+    create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        staging_buffer, staging_buffer_memory);
+
+    // Host visible memory is persistently mapped by the arena.
+    memcpy(staging_buffer_memory.mapped, data, static_cast<size_t>(size));
+
+    create_buffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, buffer_memory);
+    copy_buffer(staging_buffer, buffer, size);
+
+    vkDestroyBuffer(device, staging_buffer, nullptr);
+    em_memory::free(staging_buffer_memory);
+}
+
+// The uniforms of all draw calls without --animate, they never change.
+void create_static_draw_uniforms_buffer()
+{
+    std::vector<DrawUniforms> uniforms(draw_call_count, {{1.0f, 1.0f, 1.0f, 1.0f}, 0.0f, {}});
+
+    create_device_local_buffer(uniforms.data(), sizeof(uniforms[0]) * uniforms.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, static_draw_uniforms_buffer, static_draw_uniforms_memory);
+}
+
+void create_descriptor_sets()
+{
+    VkDescriptorPoolSize pool_size {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    pool_size.descriptorCount = 2;
+
+    VkDescriptorPoolCreateInfo pool_info {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    pool_info.maxSets = 2;
+
+    if (vkCreateDescriptorPool(device, &pool_info, nullptr, &descriptor_pool) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create descriptor pool!");
+    }
+
+    std::array<VkDescriptorSetLayout, 2> layouts = {descriptor_set_layout, descriptor_set_layout};
+    std::array<VkDescriptorSet, 2> descriptor_sets;
+
+    VkDescriptorSetAllocateInfo alloc_info {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = descriptor_pool;
+    alloc_info.descriptorSetCount = static_cast<uint32_t>(layouts.size());
+    alloc_info.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(device, &alloc_info, descriptor_sets.data()) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate descriptor set!");
+    }
+
+    draw_uniforms_descriptor_set = descriptor_sets[0];
+    static_draw_uniforms_descriptor_set = descriptor_sets[1];
+
+    // A single descriptor covers the uniforms of all draw calls, for the ring buffer the dynamic offset selects the frame's copy.
+    VkDeviceSize uniforms_size = sizeof(DrawUniforms) * draw_call_count;
+    std::array<VkDescriptorBufferInfo, 2> buffer_infos {};
+    buffer_infos[0] = {em_frame_ring::buffer(), 0, uniforms_size};
+    buffer_infos[1] = {static_draw_uniforms_buffer, 0, uniforms_size};
+
+    std::array<VkWriteDescriptorSet, 2> descriptor_writes {};
+    for (uint32_t i = 0; i < descriptor_writes.size(); i++)
+    {
+        descriptor_writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[i].dstSet = descriptor_sets[i];
+        descriptor_writes[i].dstBinding = 0;
+        descriptor_writes[i].dstArrayElement = 0;
+        descriptor_writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        descriptor_writes[i].descriptorCount = 1;
+        descriptor_writes[i].pBufferInfo = &buffer_infos[i];
+    }
+
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptor_writes.size()), descriptor_writes.data(), 0, nullptr);
+}
+
+void create_vertex_buffer()
+{
+    create_device_local_buffer(vertices.data(), sizeof(vertices[0]) * vertices.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, vertex_buffer, vertex_buffer_memory);
+}
+
+// Pseudo random but stable depth of an object, in [0.05, 0.95].
+float object_depth(uint32_t draw)
+{
+    uint32_t hash = draw * 2654435761u;
+    hash ^= hash >> 16;
+
+    return 0.05f + 0.9f * static_cast<float>(hash & 0xFFFF) / 0xFFFF;
+}
+
+void create_instance_buffer()
+{
+    // Lay the instances out on a square grid covering the whole viewport.
+    uint32_t grid_size = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(instance_count))));
+    float cell_size = 2.0f / grid_size;
+
+    std::vector<InstanceData> instances(instance_count);
+    for (uint32_t i = 0; i < instance_count; i++)
+    {
+        instances[i].offset[0] = -1.0f + cell_size * (i % grid_size + 0.5f);
+        instances[i].offset[1] = -1.0f + cell_size * (i / grid_size + 0.5f);
+        instances[i].scale = instance_overlap / grid_size;
+    }
+
+    // Every draw call is an object, bounded by the triangles of its instances (they never reach further than 0.8 of their scale).
+    objects.resize(draw_call_count);
+    for (uint32_t draw = 0; draw < draw_call_count; draw++)
+    {
+        ObjectData& object = objects[draw];
+        object.first_instance = static_cast<uint32_t>(static_cast<uint64_t>(instance_count) * draw / draw_call_count);
+        object.instance_count = static_cast<uint32_t>(static_cast<uint64_t>(instance_count) * (draw + 1) / draw_call_count) - object.first_instance;
+
+        object.bounds_min[0] = object.bounds_min[1] = std::numeric_limits<float>::max();
+        object.bounds_max[0] = object.bounds_max[1] = std::numeric_limits<float>::lowest();
+
+        for (uint32_t i = object.first_instance; i < object.first_instance + object.instance_count; i++)
+        {
+            instances[i].depth = object_depth(draw);
+            instances[i].draw = draw;
+
+            float radius = 0.8f * instances[i].scale;
+            for (int axis = 0; axis < 2; axis++)
+            {
+                object.bounds_min[axis] = std::min(object.bounds_min[axis], instances[i].offset[axis] - radius);
+                object.bounds_max[axis] = std::max(object.bounds_max[axis], instances[i].offset[axis] + radius);
+            }
+        }
+    }
+
+    create_device_local_buffer(instances.data(), sizeof(instances[0]) * instances.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, instance_buffer, instance_buffer_memory);
+
+    draw_order.resize(draw_call_count);
+    std::iota(draw_order.begin(), draw_order.end(), 0);
+
+    // Reverse-Z, so the nearest objects have the largest depth.
+    if (sort_front_to_back)
+    {
+        std::stable_sort(draw_order.begin(), draw_order.end(), [](uint32_t a, uint32_t b) { return object_depth(a) > object_depth(b); });
+    }
+}
+
+// Object buffer, indirect buffers and descriptor sets of the GPU culling pass.
+void create_cull_resources()
+{
+    create_device_local_buffer(objects.data(), sizeof(objects[0]) * objects.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, object_buffer, object_buffer_memory);
+
+    VkDeviceSize commands_size = sizeof(VkDrawIndirectCommand) * objects.size();
+
+    indirect_buffers.resize(max_frames_in_flight);
+    indirect_buffer_memory.resize(max_frames_in_flight);
+    for (uint32_t i = 0; i < max_frames_in_flight; i++)
+    {
+        create_buffer(INDIRECT_COMMANDS_OFFSET + commands_size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indirect_buffers[i], indirect_buffer_memory[i]);
+    }
+
+    std::array<VkDescriptorPoolSize, 2> pool_sizes {};
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[0].descriptorCount = 3 * max_frames_in_flight;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    pool_sizes[1].descriptorCount = max_frames_in_flight;
+
+    VkDescriptorPoolCreateInfo pool_info {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+    pool_info.pPoolSizes = pool_sizes.data();
+    pool_info.maxSets = max_frames_in_flight;
+
+    if (vkCreateDescriptorPool(device, &pool_info, nullptr, &cull_descriptor_pool) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create cull descriptor pool!");
+    }
+
+    std::vector<VkDescriptorSetLayout> layouts(max_frames_in_flight, cull_descriptor_set_layout);
+
+    VkDescriptorSetAllocateInfo alloc_info {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = cull_descriptor_pool;
+    alloc_info.descriptorSetCount = max_frames_in_flight;
+    alloc_info.pSetLayouts = layouts.data();
+
+    cull_descriptor_sets.resize(max_frames_in_flight);
+    if (vkAllocateDescriptorSets(device, &alloc_info, cull_descriptor_sets.data()) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate cull descriptor sets!");
+    }
+
+    for (uint32_t i = 0; i < max_frames_in_flight; i++)
+    {
+        std::array<VkDescriptorBufferInfo, 4> buffer_infos {};
+        buffer_infos[0] = {object_buffer, 0, VK_WHOLE_SIZE};
+        buffer_infos[1] = {indirect_buffers[i], INDIRECT_COMMANDS_OFFSET, commands_size};
+        buffer_infos[2] = {indirect_buffers[i], 0, sizeof(uint32_t)};
+        buffer_infos[3] = {em_frame_ring::buffer(), 0, sizeof(DrawUniforms) * draw_call_count};
+
+        std::array<VkWriteDescriptorSet, 4> descriptor_writes {};
+        for (uint32_t binding = 0; binding < descriptor_writes.size(); binding++)
+        {
+            descriptor_writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptor_writes[binding].dstSet = cull_descriptor_sets[i];
+            descriptor_writes[binding].dstBinding = binding;
+            descriptor_writes[binding].descriptorType = binding == 3 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptor_writes[binding].descriptorCount = 1;
+            descriptor_writes[binding].pBufferInfo = &buffer_infos[binding];
+        }
+
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptor_writes.size()), descriptor_writes.data(), 0, nullptr);
+    }
+}
+
+void destroy_cull_resources()
+{
+    if (cull_pipeline == VK_NULL_HANDLE) return;
+
+    vkDestroyDescriptorPool(device, cull_descriptor_pool, nullptr);
+    for (uint32_t i = 0; i < indirect_buffers.size(); i++)
+    {
+        vkDestroyBuffer(device, indirect_buffers[i], nullptr);
+        em_memory::free(indirect_buffer_memory[i]);
+    }
+
+    vkDestroyBuffer(device, object_buffer, nullptr);
+    em_memory::free(object_buffer_memory);
+
+    vkDestroyPipeline(device, cull_pipeline, nullptr);
+    vkDestroyPipelineLayout(device, cull_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(device, cull_descriptor_set_layout, nullptr);
+}
+
+/* #endregion */
+
+void destroy_render_targets(std::vector<RenderTarget>& targets)
+{
+    for (const RenderTarget& target : targets)
+    {
+        vkDestroyImageView(device, target.view, nullptr);
+        vkDestroyImage(device, target.image, nullptr);
+        em_memory::free(target.memory);
+    }
+
+    targets.clear();
+}
+
+void cleanup_swap_chain()
+{
+    for (VkFramebuffer framebuffer : swap_chain_framebuffers)
+    {
+        vkDestroyFramebuffer(device, framebuffer, nullptr);
+    }
+
+    destroy_render_targets(depth_targets);
+    destroy_render_targets(msaa_color_targets);
+
+    for (VkImageView image_view : swap_chain_image_views)
+    {
+        vkDestroyImageView(device, image_view, nullptr);
+    }
+
+    if (headless)
+    {
+        for (size_t i = 0; i < swap_chain_images.size(); i++)
+        {
+            vkDestroyImage(device, swap_chain_images[i], nullptr);
+            em_memory::free(offscreen_image_memory[i]);
+        }
+
+        return;
+    }
+
+    vkDestroySwapchainKHR(device, swap_chain, nullptr);
+}
+
+void destroy_retired_swap_chain(RetiredSwapChain& retired)
+{
+    for (VkFramebuffer framebuffer : retired.framebuffers) vkDestroyFramebuffer(device, framebuffer, nullptr);
+    for (VkImageView image_view : retired.image_views) vkDestroyImageView(device, image_view, nullptr);
+    destroy_render_targets(retired.depth_targets);
+    destroy_render_targets(retired.msaa_color_targets);
+    vkDestroySwapchainKHR(device, retired.swap_chain, nullptr);
+
+    retired.framebuffers.clear();
+    retired.image_views.clear();
+    retired.in_use = false;
+}
+
+void create_retired_swap_chain_slots()
+{
+    // Every resize retires one swap chain, which lives for max_frames_in_flight frames.
+    retired_swap_chains.resize(max_frames_in_flight + 1);
+
+    for (RetiredSwapChain& retired : retired_swap_chains)
+    {
+        retired.image_views.reserve(swap_chain_images.size());
+        retired.framebuffers.reserve(swap_chain_images.size());
+        retired.depth_targets.reserve(swap_chain_images.size());
+        retired.msaa_color_targets.reserve(swap_chain_images.size());
+    }
+}
+
+void release_retired_swap_chains()
+{
+    for (RetiredSwapChain& retired : retired_swap_chains)
+    {
+        if (retired.in_use && retired.last_frame <= completed_frames) destroy_retired_swap_chain(retired);
+    }
+}
+
+RetiredSwapChain& find_free_retired_swap_chain_slot()
+{
+    for (RetiredSwapChain& retired : retired_swap_chains)
+    {
+        if (!retired.in_use) return retired;
+    }
+
+    // Several resizes without a frame in between. Waiting for the submitted frames is still cheaper than idling the device.
+    wait_for_frame(submitted_frame_count);
+
+    for (RetiredSwapChain& retired : retired_swap_chains)
+    {
+        destroy_retired_swap_chain(retired);
+    }
+
+    return retired_swap_chains[0];
+}
+
+void recreate_swap_chain()
+{
+    // Wait for minimization
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(window, &width, &height);
+    while (width == 0 || height == 0)
+    {
+        glfwGetFramebufferSize(window, &width, &height);
+        glfwWaitEvents();
+    }
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    if (resize_wait_idle)
+    {
+        vkDeviceWaitIdle(device);
+
+        cleanup_swap_chain();
+        create_swap_chain();
+    }
+    else
+    {
+        // The frames in flight keep using the old image views and framebuffers, swapping the vectors
+        // hands them to the slot and reuses the slot's storage for the new ones.
+        RetiredSwapChain& retired = find_free_retired_swap_chain_slot();
+        retired.swap_chain = swap_chain;
+        retired.image_views.swap(swap_chain_image_views);
+        retired.framebuffers.swap(swap_chain_framebuffers);
+        retired.depth_targets.swap(depth_targets);
+        retired.msaa_color_targets.swap(msaa_color_targets);
+        retired.last_frame = submitted_frame_count;
+        retired.in_use = true;
+
+        create_swap_chain(retired.swap_chain);
+    }
+
+    create_image_views();
+    create_render_targets();
+    create_framebuffers();
+
+    swap_chain_first_present_id = present_id + 1;
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+
+    present_statistics.resize_count++;
+    present_statistics.resize_total_ms += elapsed.count();
+    present_statistics.resize_max_ms = std::max(present_statistics.resize_max_ms, elapsed.count());
+}
+
+void create_sync_objects()
+{
+    image_available_semaphores.resize(max_frames_in_flight);
+    render_finished_semaphores.resize(max_frames_in_flight);
+    in_flight_fences.resize(use_timeline_semaphores ? 0 : max_frames_in_flight);
+    frame_slot_values.assign(max_frames_in_flight, 0);
+
+    VkSemaphoreCreateInfo semaphore_info {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    VkFenceCreateInfo fence_info{};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (size_t i = 0; i < max_frames_in_flight; i++)
+    {
+        if (vkCreateSemaphore(device, &semaphore_info, nullptr, &image_available_semaphores[i]) != VK_SUCCESS ||
+            vkCreateSemaphore(device, &semaphore_info, nullptr, &render_finished_semaphores[i]) != VK_SUCCESS ||
+            (!use_timeline_semaphores && vkCreateFence(device, &fence_info, nullptr, &in_flight_fences[i]) != VK_SUCCESS))
+        {
+            throw std::runtime_error("Failed to create one or more sync objects!");
+        }
+    }
+
+    if (!use_timeline_semaphores) return;
+
+    VkSemaphoreTypeCreateInfo semaphore_type_info {};
+    semaphore_type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    semaphore_type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    semaphore_type_info.initialValue = 0;
+
+    semaphore_info.pNext = &semaphore_type_info;
+
+    if (vkCreateSemaphore(device, &semaphore_info, nullptr, &frame_timeline) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create frame timeline semaphore!");
+    }
+}
+
+void draw_frame()
+{
+    em_profiler::begin_frame();
+
+    em_profiler::begin_phase(em_profiler::PHASE_WAIT_FENCE);
+    wait_for_frame(frame_slot_values[current_frame]);
+    em_profiler::end_phase(em_profiler::PHASE_WAIT_FENCE);
+
+    // Frames after the one waited for may have finished as well.
+    update_completed_frames();
+
+    // The previous submission of this frame slot has finished, so its GPU timestamps can be read without stalling.
+    em_profiler::collect_gpu_timings(device, current_frame);
+
+    swap_rebuilt_pipeline();
+    release_retired_swap_chains();
+
+    // Input received up to this point is handled by this frame.
+    bool frame_has_input = input_pending;
+    std::chrono::steady_clock::time_point frame_input_time = input_time;
+    input_pending = false;
+
+    uint32_t image_index;
+    VkResult result;
+
+    if (headless)
+    {
+        // Offscreen images are simply used round robin.
+        image_index = next_offscreen_image;
+        next_offscreen_image = (next_offscreen_image + 1) % static_cast<uint32_t>(swap_chain_images.size());
+    }
+    else
+    {
+        em_profiler::begin_phase(em_profiler::PHASE_ACQUIRE);
+        result = vkAcquireNextImageKHR(device, swap_chain, UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
+        em_profiler::end_phase(em_profiler::PHASE_ACQUIRE);
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR)
+        {
+            recreate_swap_chain();
+            return;
+        }
+        else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+        {
+            throw std::runtime_error("Failed to acquire swap chain image!");
+        }
+    }
+
+    // When there are more frames in flight than images, the image might still be used by another frame.
+    wait_for_frame(image_frame_values[image_index]);
+
+    uint64_t frame_value = submitted_frame_count + 1;
+    image_frame_values[image_index] = frame_value;
+    frame_slot_values[current_frame] = frame_value;
+
+    if (!use_timeline_semaphores) vkResetFences(device, 1, &in_flight_fences[current_frame]);
+
+    em_profiler::begin_phase(em_profiler::PHASE_RECORD);
+    vkResetCommandBuffer(command_buffers[current_frame], 0);
+    record_command_buffer(command_buffers[current_frame], image_index);
+    em_profiler::end_phase(em_profiler::PHASE_RECORD);
+
+    VkSubmitInfo submit_info {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+    VkSemaphore wait_semaphores[] = {image_available_semaphores[current_frame]};
+    VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+
+    // Nothing is acquired or presented in headless mode, so there are no semaphores to wait on or signal.
+    submit_info.waitSemaphoreCount = headless ? 0 : 1;
+    submit_info.pWaitSemaphores = wait_semaphores;
+    submit_info.pWaitDstStageMask = wait_stages;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &command_buffers[current_frame];
+
+    VkSemaphore signal_semaphores[2];
+    uint64_t signal_values[2] = {0, 0}; // Ignored for binary semaphores
+    uint32_t signal_count = 0;
+
+    if (!headless) signal_semaphores[signal_count++] = render_finished_semaphores[current_frame];
+    if (use_timeline_semaphores)
+    {
+        signal_values[signal_count] = frame_value;
+        signal_semaphores[signal_count++] = frame_timeline;
+    }
+
+    submit_info.signalSemaphoreCount = signal_count;
+    submit_info.pSignalSemaphores = signal_semaphores;
+
+    uint64_t wait_values[] = {0};
+
+    VkTimelineSemaphoreSubmitInfo timeline_info {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = submit_info.waitSemaphoreCount;
+    timeline_info.pWaitSemaphoreValues = wait_values;
+    timeline_info.signalSemaphoreValueCount = signal_count;
+    timeline_info.pSignalSemaphoreValues = signal_values;
+
+    if (use_timeline_semaphores) submit_info.pNext = &timeline_info;
+
+    em_profiler::begin_phase(em_profiler::PHASE_SUBMIT);
+    if (use_timeline_semaphores)
+    {
+        em_upload::collect(completed_frames);
+        em_upload::submit_acquires(frame_value);
+    }
+
+    VkFence fence = use_timeline_semaphores ? VK_NULL_HANDLE : in_flight_fences[current_frame];
+    if (vkQueueSubmit(graphics_queue, 1, &submit_info, fence) != VK_SUCCESS) 
+    {
+        throw std::runtime_error("Failed to submit draw command buffer!");
+    }
+    em_profiler::end_phase(em_profiler::PHASE_SUBMIT);
+
+    submitted_frame_count++;
+
+    if (!headless)
+    {
+        VkPresentInfoKHR present_info {};
+        present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        present_info.waitSemaphoreCount = 1;
+        present_info.pWaitSemaphores = signal_semaphores;
+
+        VkSwapchainKHR swap_chains[] = {swap_chain};
+        present_info.swapchainCount = 1;
+        present_info.pSwapchains = swap_chains;
+        present_info.pImageIndices = &image_index;
+        present_info.pResults = nullptr;
+
+        VkPresentIdKHR present_id_info {};
+        present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+        present_id_info.swapchainCount = 1;
+        present_id_info.pPresentIds = &present_id;
+
+        if (use_present_wait)
+        {
+            present_id++;
+            present_info.pNext = &present_id_info;
+        }
+
+        em_profiler::begin_phase(em_profiler::PHASE_PRESENT);
+        result = vkQueuePresentKHR(present_queue, &present_info);
+        em_profiler::end_phase(em_profiler::PHASE_PRESENT);
+
+        present_statistics.presented_frames++;
+
+        if (frame_has_input)
+        {
+            std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - frame_input_time;
+
+            present_statistics.latency_samples++;
+            present_statistics.latency_total_ms += latency.count();
+            present_statistics.latency_max_ms = std::max(present_statistics.latency_max_ms, latency.count());
+        }
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebuffer_resized)
+        {
+            framebuffer_resized = false;
+            recreate_swap_chain();
+        }
+        else if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to present swap chain image!");
+        }
+    }
+
+    em_profiler::end_frame();
+
+    if (!first_frame_reported)
+    {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - launch_time;
+        std::cout << "Time to first frame: " << elapsed.count() << " ms" << std::endl;
+
+        em_profiler::record_metric("first_frame_ms", elapsed.count());
+        first_frame_reported = true;
+    }
+
+    current_frame = (current_frame + 1) % max_frames_in_flight;
+}
+
+// Startup runs as a task graph. Loading the shaders and building the pipeline overlap creating the window,
+// the surface and the swap chain, everything that only needs the device runs in parallel as well.
+void init_vulkan()
+{
+    using em_task_graph::TaskId;
+
+    // GLFW has to be initialized and create its windows on the main thread. The instance needs GLFW for its extensions.
+    TaskId glfw_task = em_task_graph::add("glfw", [] { if (!headless) glfwInit(); }, {}, em_task_graph::MAIN_THREAD);
+    TaskId window_task = em_task_graph::add("window", [] { if (!headless) init_window(); }, {glfw_task}, em_task_graph::MAIN_THREAD);
+    TaskId instance_task = em_task_graph::add("instance", create_vulkan_instance, {glfw_task});
+    TaskId shader_code_task = em_task_graph::add("shader_code", preload_shader_code);
+    TaskId surface_task = em_task_graph::add("surface", [] { if (!headless) create_surface(); }, {window_task, instance_task});
+
+    TaskId device_task = em_task_graph::add("device", [] {
+        pick_physical_device();
+        create_logical_device();
+        em_memory::init(physical_device, device);
+        choose_color_format();
+        choose_depth_format();
+    }, {surface_task});
+
+    // Picking the extent can query the framebuffer size, which GLFW only allows on the main thread.
+    TaskId swap_chain_task = em_task_graph::add("swap_chain", [] {
+        if (headless) create_offscreen_targets();
+        else create_swap_chain();
+
+        create_image_views();
+        create_render_targets();
+    }, {device_task}, em_task_graph::MAIN_THREAD);
+
+    // The benchmark compares against the render pass, so it needs both.
+    TaskId render_pass_task = em_task_graph::add("render_pass", [] {
+        if (!use_dynamic_rendering || run_render_path_benchmark) create_render_pass();
+    }, {device_task});
+
+    TaskId pipeline_cache_task = em_task_graph::add("pipeline_cache", create_pipeline_cache, {device_task});
+    TaskId pipeline_task = em_task_graph::add("pipeline", create_graphics_pipeline, {shader_code_task, render_pass_task, pipeline_cache_task});
+    em_task_graph::add("framebuffers", create_framebuffers, {swap_chain_task, render_pass_task});
+
+    TaskId commands_task = em_task_graph::add("commands", [] {
+        create_command_pool();
+        create_command_buffers();
+
+        em_workers::start(record_thread_count);
+        create_worker_command_buffers();
+    }, {device_task});
+
+    TaskId buffers_task = em_task_graph::add("buffers", [] {
+        if (use_timeline_semaphores)
+        {
+            em_upload::init(device, device_queue_families.transfer_family.value(), transfer_queue,
+                device_queue_families.graphics_family.value(), graphics_queue);
+
+            std::cout << "Uploading on queue family " << device_queue_families.transfer_family.value()
+                << (device_queue_families.transfer_family != device_queue_families.graphics_family ? " (dedicated transfer queue)" : "") << std::endl;
+        }
+
+        // Room for the animated uniforms of every draw call, the culling shader writes them with --gpu-driven.
+        em_frame_ring::init(physical_device, device, max_frames_in_flight, std::max<VkDeviceSize>(64 * 1024, sizeof(DrawUniforms) * draw_call_count));
+
+        create_vertex_buffer();
+        create_instance_buffer();
+        create_static_draw_uniforms_buffer();
+
+        // The benchmark compares against CPU culling, so it needs both.
+        if (supports_gpu_driven_rendering && (gpu_driven_rendering || run_cull_benchmark))
+        {
+            create_cull_pipeline();
+            create_cull_resources();
+        }
+
+        // The first frame waits for the uploads on the GPU, the CPU continues right away.
+        if (use_timeline_semaphores) em_upload::flush();
+    }, {commands_task, shader_code_task, pipeline_cache_task});
+
+    // The descriptor set layout is created with the pipeline layout.
+    em_task_graph::add("uniforms", create_descriptor_sets, {pipeline_task, buffers_task});
+
+    em_task_graph::add("sync", [] {
+        create_sync_objects();
+        if (!headless) create_retired_swap_chain_slots();
+
+        // Queries can't be active while secondary command buffers are executed, unless they inherit them.
+        bool pipeline_statistics = supports_pipeline_statistics
+            && (supports_inherited_queries || (record_thread_count == 0 && !run_record_benchmark));
+
+        em_profiler::init(physical_device, device, device_queue_families.graphics_family.value(), max_frames_in_flight, pipeline_statistics);
+    }, {swap_chain_task});
+
+    uint32_t worker_count = serial_startup ? 0 : std::min(4u, std::max(1u, std::thread::hardware_concurrency()) - 1);
+    em_task_graph::run(worker_count);
+
+    release_preloaded_shader_code();
 
-    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
+    // Measured by the pipeline task, the profiler is only used from the main thread.
+    em_profiler::record_metric("shader_load_ms", startup_pipeline_timings.shader_load_ms);
+    em_profiler::record_metric("pipeline_ms", startup_pipeline_timings.create_ms);
+    em_profiler::record_metric("pipeline_cache_warm", pipeline_cache_warm ? 1.0 : 0.0);
 
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = static_cast<float>(swap_chain_extent.width);
-    viewport.height = static_cast<float>(swap_chain_extent.height);
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    std::cout << "Startup tasks (" << (worker_count == 0 ? std::string("serial") : std::to_string(worker_count) + " workers") << "):" << std::endl;
+    em_task_graph::print_timeline(std::cout);
 
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = swap_chain_extent;
-    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+    // Without lazily allocated memory every sample is written to and resolved from memory, this is what that costs per frame.
+    std::cout << "Render targets: " << msaa_samples << "x MSAA, " << render_target_bytes / 1024 << " KiB per frame in "
+        << (render_targets_lazily_allocated ? "lazily allocated" : "device local") << " memory" << std::endl;
+    em_profiler::record_metric("msaa_samples", msaa_samples);
+    em_profiler::record_metric("render_target_kb", render_target_bytes / 1024.0);
+    em_profiler::record_metric("render_targets_lazy", render_targets_lazily_allocated ? 1.0 : 0.0);
+}
 
-    vkCmdDraw(command_buffer, 3, 1, 0, 0);
+// Frames rendered before the frame loop is expected to stop allocating (EM_COUNT_ALLOCATIONS builds only).
+const uint64_t ALLOCATION_WARMUP_FRAMES = 100;
+uint64_t warm_allocation_count = 0;
 
-    vkCmdEndRenderPass(command_buffer);
+void track_steady_state_allocations(uint64_t frame_number)
+{
+#ifdef EM_COUNT_ALLOCATIONS
+    if (frame_number == ALLOCATION_WARMUP_FRAMES) warm_allocation_count = em_allocations::count();
+#endif
+}
 
-    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS)
+void verify_steady_state_allocations(uint64_t frame_count)
+{
+#ifdef EM_COUNT_ALLOCATIONS
+    if (frame_count <= ALLOCATION_WARMUP_FRAMES)
     {
-        throw std::runtime_error("Failed to record command buffer!");
+        std::cout << "Not enough frames rendered to verify steady-state allocations." << std::endl;
+        return;
     }
+
+    uint64_t allocations = em_allocations::count() - warm_allocation_count;
+    std::cout << allocations << " heap allocations in " << frame_count - ALLOCATION_WARMUP_FRAMES << " steady-state frames" << std::endl;
+
+    if (allocations != 0) throw std::runtime_error("The frame loop allocated after warming up!");
+#endif
 }
 
-void create_command_pool()
+void print_present_statistics()
 {
-    QueueFamilyIndices queue_family_indices = find_queue_families(physical_device);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - present_statistics.start_time;
 
-    VkCommandPoolCreateInfo pool_info {};
-    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    pool_info.queueFamilyIndex = queue_family_indices.graphics_family.value();
+    std::cout << "Present mode " << present_mode_name(swap_chain_present_mode) << ": "
+        << present_statistics.presented_frames << " frames in " << elapsed.count() << " s ("
+        << present_statistics.presented_frames / elapsed.count() << " fps, "
+        << present_statistics.presented_frames * static_cast<double>(instance_count) / elapsed.count() << " triangles/s)" << std::endl;
 
-    if (vkCreateCommandPool(device, &pool_info, nullptr, &command_pool) != VK_SUCCESS)
+    if (present_statistics.resize_count > 0)
     {
-        throw std::runtime_error("Failed to create command pool!");
+        std::cout << "Swap chain recreation" << (resize_wait_idle ? " (device idle)" : "") << ": mean "
+            << present_statistics.resize_total_ms / present_statistics.resize_count << " ms, max "
+            << present_statistics.resize_max_ms << " ms over " << present_statistics.resize_count << " resizes" << std::endl;
     }
+
+    if (present_statistics.latency_samples == 0) return;
+
+    std::cout << "Input-to-present latency: mean "
+        << present_statistics.latency_total_ms / present_statistics.latency_samples << " ms, max "
+        << present_statistics.latency_max_ms << " ms over " << present_statistics.latency_samples << " inputs" << std::endl;
 }
 
-void create_command_buffers()
+// Headless counterpart of recreate_swap_chain. Without a swap chain to hand the old images to, it waits for the device.
+void resize_offscreen_targets(VkExtent2D extent)
 {
-    command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
 
-    VkCommandBufferAllocateInfo alloc_info {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    alloc_info.commandPool = command_pool;
-    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    alloc_info.commandBufferCount = (uint32_t) command_buffers.size();
+    vkDeviceWaitIdle(device);
 
-    if (vkAllocateCommandBuffers(device, &alloc_info, command_buffers.data()) != VK_SUCCESS)
-    {
-        throw std::runtime_error("Failed to allocate command buffers!");
-    }
-}
+    cleanup_swap_chain();
+    create_offscreen_targets(extent);
+    create_image_views();
+    create_render_targets();
+    create_framebuffers();
 
-/* #endregion */
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
 
-void cleanup_swap_chain()
+    present_statistics.resize_count++;
+    present_statistics.resize_total_ms += elapsed.count();
+    present_statistics.resize_max_ms = std::max(present_statistics.resize_max_ms, elapsed.count());
+}
+
+void start_headless_loop()
 {
-    for (VkFramebuffer framebuffer : swap_chain_framebuffers)
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < headless_frame_count; i++)
     {
-        vkDestroyFramebuffer(device, framebuffer, nullptr);
+        // Alternates between the full and half size, every size change is a resize.
+        if (headless_resize_interval > 0 && i > 0 && i % headless_resize_interval == 0)
+        {
+            bool half_size = (i / headless_resize_interval) % 2 == 1;
+            resize_offscreen_targets(half_size ? VkExtent2D {WIDTH / 2, HEIGHT / 2} : VkExtent2D {WIDTH, HEIGHT});
+        }
+
+        track_steady_state_allocations(i);
+        draw_frame();
     }
 
-    for (VkImageView image_view : swap_chain_image_views)
+    vkDeviceWaitIdle(device);
+    verify_steady_state_allocations(headless_frame_count);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+    double frames_per_second = headless_frame_count / (elapsed.count() / 1000.0);
+
+    std::cout << "Rendered " << headless_frame_count << " headless frames of " << instance_count << " triangles in "
+        << elapsed.count() << " ms (" << frames_per_second << " fps, "
+        << frames_per_second * instance_count << " triangles/s)" << std::endl;
+
+    em_profiler::record_metric("fps", frames_per_second);
+
+    if (present_statistics.resize_count > 0)
     {
-        vkDestroyImageView(device, image_view, nullptr);
-    }
+        std::cout << "Offscreen target recreation: mean " << present_statistics.resize_total_ms / present_statistics.resize_count
+            << " ms, max " << present_statistics.resize_max_ms << " ms over " << present_statistics.resize_count << " resizes" << std::endl;
 
-    vkDestroySwapchainKHR(device, swap_chain, nullptr);
+        em_profiler::record_metric("resize_mean_ms", present_statistics.resize_total_ms / present_statistics.resize_count);
+        em_profiler::record_metric("resize_max_ms", present_statistics.resize_max_ms);
+    }
 }
 
-void recreate_swap_chain()
+// Measures the CPU time it takes to record a frame with 0 (inline) up to N recording threads.
+void run_recording_benchmark()
 {
-    // Wait for minimization
-    int width = 0, height = 0;
-    glfwGetFramebufferSize(window, &width, &height);
-    while (width == 0 || height == 0)
-    {
-        glfwGetFramebufferSize(window, &width, &height);
-        glfwWaitEvents();
-    }
+    const uint32_t iterations = 200;
+    uint32_t max_threads = record_thread_count > 0 ? record_thread_count : std::max(1u, std::thread::hardware_concurrency());
 
-    // Reset swap chain
     vkDeviceWaitIdle(device);
 
-    cleanup_swap_chain();
+    std::cout << "Recording " << draw_call_count << " draw calls (" << instance_count << " instances), "
+        << iterations << " iterations:" << std::endl;
 
-    create_swap_chain();
-    create_image_views();
-    create_framebuffers();
-}
+    double single_thread_ms = 0.0;
 
-void create_sync_objects()
-{
-    image_available_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    render_finished_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    in_flight_fences.resize(MAX_FRAMES_IN_FLIGHT);
+    for (uint32_t threads = 0; threads <= max_threads; threads++)
+    {
+        destroy_worker_command_buffers();
+        em_workers::stop();
 
-    VkSemaphoreCreateInfo semaphore_info {};
-    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        em_workers::start(threads);
+        create_worker_command_buffers();
 
-    VkFenceCreateInfo fence_info{};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-    {
-        if (vkCreateSemaphore(device, &semaphore_info, nullptr, &image_available_semaphores[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(device, &semaphore_info, nullptr, &render_finished_semaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(device, &fence_info, nullptr, &in_flight_fences[i]) != VK_SUCCESS)
+        for (uint32_t i = 0; i < iterations; i++)
         {
-            throw std::runtime_error("Failed to create one or more sync objects!");
+            vkResetCommandBuffer(command_buffers[current_frame], 0);
+            record_command_buffer(command_buffers[current_frame], 0);
+        }
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+        double frame_ms = elapsed.count() / iterations;
+
+        if (threads == 1) single_thread_ms = frame_ms;
+
+        if (threads == 0)
+        {
+            std::cout << "  inline: " << frame_ms << " ms/frame" << std::endl;
+        }
+        else
+        {
+            std::cout << "  " << threads << " threads: " << frame_ms << " ms/frame, "
+                << single_thread_ms / frame_ms << "x speedup over 1 thread" << std::endl;
         }
     }
 }
 
-void draw_frame()
+// Renders the same frames with the render pass and with dynamic rendering, and compares the recording
+// time, the frame rate and the cost of recreating the per image render targets.
+void run_render_path_comparison()
 {
-    vkWaitForFences(device, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX);
-
-    uint32_t image_index;
-    VkResult result = vkAcquireNextImageKHR(device, swap_chain, UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
-
-    if (result == VK_ERROR_OUT_OF_DATE_KHR)
+    if (!use_dynamic_rendering)
     {
-        recreate_swap_chain();
+        std::cout << "Dynamic rendering is not supported by this device, there is nothing to compare against." << std::endl;
         return;
     }
-    else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
-    {
-        throw std::runtime_error("Failed to acquire swap chain image!");
-    }
 
-    vkResetFences(device, 1, &in_flight_fences[current_frame]);
+    const uint32_t record_iterations = 200;
+    const uint32_t recreate_iterations = 100;
+    const uint32_t frame_count = headless_frame_count;
 
-    vkResetCommandBuffer(command_buffers[current_frame], 0);
-    record_command_buffer(command_buffers[current_frame], image_index);
+    std::cout << "Comparing render paths over " << frame_count << " frames (" << instance_count << " instances, "
+        << draw_call_count << " draw calls):" << std::endl;
 
-    VkSubmitInfo submit_info {};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    for (bool dynamic : {false, true})
+    {
+        vkDeviceWaitIdle(device);
 
-    VkSemaphore wait_semaphores[] = {image_available_semaphores[current_frame]};
-    VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+        use_dynamic_rendering = dynamic;
+        vkDestroyPipeline(device, graphics_pipeline, nullptr);
+        graphics_pipeline = build_graphics_pipeline();
 
-    submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = wait_semaphores;
-    submit_info.pWaitDstStageMask = wait_stages;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &command_buffers[current_frame];
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < record_iterations; i++)
+        {
+            vkResetCommandBuffer(command_buffers[current_frame], 0);
+            record_command_buffer(command_buffers[current_frame], 0);
+        }
+        std::chrono::duration<double, std::milli> record_elapsed = std::chrono::steady_clock::now() - start_time;
 
-    VkSemaphore signal_semaphores[] = {render_finished_semaphores[current_frame]};
+        start_time = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < frame_count; i++) draw_frame();
+        vkDeviceWaitIdle(device);
+        std::chrono::duration<double, std::milli> frame_elapsed = std::chrono::steady_clock::now() - start_time;
 
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = signal_semaphores;
+        // What a resize has to rebuild on top of the swap chain and image views.
+        start_time = std::chrono::steady_clock::now();
+        if (!dynamic)
+        {
+            for (uint32_t i = 0; i < recreate_iterations; i++)
+            {
+                for (VkFramebuffer framebuffer : swap_chain_framebuffers) vkDestroyFramebuffer(device, framebuffer, nullptr);
+                create_framebuffers();
+            }
+        }
+        std::chrono::duration<double, std::milli> recreate_elapsed = std::chrono::steady_clock::now() - start_time;
 
-    if (vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fences[current_frame]) != VK_SUCCESS) 
-    {
-        throw std::runtime_error("Failed to submit draw command buffer!");
+        std::cout << "  " << (dynamic ? "dynamic rendering" : "render pass") << ": "
+            << record_elapsed.count() / record_iterations << " ms to record, "
+            << frame_elapsed.count() / frame_count << " ms/frame (" << frame_count / (frame_elapsed.count() / 1000.0) << " fps), "
+            << recreate_elapsed.count() / recreate_iterations << " ms to recreate the render targets" << std::endl;
     }
+}
 
-    VkPresentInfoKHR present_info {};
-    present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    present_info.waitSemaphoreCount = 1;
-    present_info.pWaitSemaphores = signal_semaphores;
-
-    VkSwapchainKHR swap_chains[] = {swap_chain};
-    present_info.swapchainCount = 1;
-    present_info.pSwapchains = swap_chains;
-    present_info.pImageIndices = &image_index;
-    present_info.pResults = nullptr;
+// Renders the same frames with CPU culling (a draw call per visible object) and GPU culling (one indirect draw),
+// and compares the recording time and the frame rate.
+void run_cull_comparison()
+{
+    if (!supports_gpu_driven_rendering)
+    {
+        std::cout << "drawIndirectCount is not supported by this device, there is nothing to compare against." << std::endl;
+        return;
+    }
 
-    result = vkQueuePresentKHR(present_queue, &present_info);
+    const uint32_t record_iterations = 200;
+    const uint32_t frame_count = headless_frame_count;
 
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebuffer_resized)
+    uint32_t visible_objects = 0;
+    for (const ObjectData& object : objects)
     {
-        framebuffer_resized = false;
-        recreate_swap_chain();
+        if (is_object_visible(object)) visible_objects++;
     }
-    else if (result != VK_SUCCESS)
+
+    std::cout << "Comparing CPU and GPU culling over " << frame_count << " frames (" << visible_objects << " of "
+        << objects.size() << " objects visible at zoom " << view_zoom << ", " << instance_count << " instances):" << std::endl;
+
+    for (bool gpu_driven : {false, true})
     {
-        throw std::runtime_error("Failed to present swap chain image!");
-    }
+        vkDeviceWaitIdle(device);
+        gpu_driven_rendering = gpu_driven;
 
-    current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < record_iterations; i++)
+        {
+            vkResetCommandBuffer(command_buffers[current_frame], 0);
+            record_command_buffer(command_buffers[current_frame], 0);
+        }
+        std::chrono::duration<double, std::milli> record_elapsed = std::chrono::steady_clock::now() - start_time;
+
+        start_time = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < frame_count; i++) draw_frame();
+        vkDeviceWaitIdle(device);
+        std::chrono::duration<double, std::milli> frame_elapsed = std::chrono::steady_clock::now() - start_time;
+
+        std::cout << "  " << (gpu_driven ? "GPU-driven" : "CPU-driven") << ": "
+            << record_elapsed.count() / record_iterations << " ms to record, "
+            << frame_elapsed.count() / frame_count << " ms/frame (" << frame_count / (frame_elapsed.count() / 1000.0) << " fps)" << std::endl;
+    }
 }
 
-void init_vulkan()
+// Waits until at most max_queued_presents presents (including the next one) are waiting to be displayed.
+void wait_for_queued_presents()
 {
-    create_vulkan_instance();
-    // setupDebugMessenger();
-    create_surface();
-    pick_physical_device();
-    create_logical_device();
-    create_swap_chain();
-    create_image_views();
-    
-    create_render_pass();
-    create_graphics_pipeline();
+    if (!use_present_wait || present_id + 1 <= max_queued_presents) return;
 
-    create_framebuffers();
-
-    create_command_pool();
-    create_command_buffers();
+    uint64_t wait_id = present_id + 1 - max_queued_presents;
+    if (wait_id < swap_chain_first_present_id) return;
 
-    create_sync_objects();
+    // Time out instead of hanging when nothing is displayed (e.g. the window is hidden), out of date
+    // swap chains are handled when acquiring the next image.
+    const uint64_t timeout_ns = 100000000;
+    wait_for_present(device, swap_chain, wait_id, timeout_ns);
 }
 
 void start_main_loop()
 {
+    if (headless)
+    {
+        start_headless_loop();
+        return;
+    }
+
+    present_statistics.start_time = std::chrono::steady_clock::now();
+
+    // The compiled shaders are in the working directory, the GLSL sources are only watched when the build can recompile them.
+    std::vector<std::string> shader_directories = {"shaders"};
+#ifdef EM_SHADER_SOURCE_DIR
+    shader_directories.push_back(EM_SHADER_SOURCE_DIR);
+#endif
+
+    if (hot_reload_shaders && !em_shader_watcher::start(shader_directories))
+    {
+        std::cout << "Unable to watch the shaders directory, hot reloading is disabled." << std::endl;
+        hot_reload_shaders = false;
+    }
+
+    uint64_t frame_number = 0;
+    em_frame_pacer::start();
+
     while (!glfwWindowShouldClose(window)) 
     {
+        track_steady_state_allocations(frame_number++);
+
+        // Sleep before polling events, so the frame is rendered with the most recent input.
+        wait_for_queued_presents();
+        em_frame_pacer::wait_for_next_frame();
+
         glfwPollEvents();
+        if (hot_reload_shaders) poll_shader_reload();
+
         draw_frame();
     }
 
     vkDeviceWaitIdle(device);
+    verify_steady_state_allocations(frame_number);
+
+    em_frame_pacer::stop();
+
+    print_present_statistics();
+    em_frame_pacer::print_statistics(std::cout);
 }
 
 void cleanup() 
 {
+    em_profiler::print_summary(std::cout);
+    if (!profile_output_path.empty()) em_profiler::write_results(profile_output_path);
+    if (!metrics_output_path.empty()) em_profiler::write_metrics(metrics_output_path);
+    em_profiler::destroy(device);
+
+    em_memory::print_statistics(std::cout);
+
+    cleanup_shader_reload();
     cleanup_swap_chain();
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    for (RetiredSwapChain& retired : retired_swap_chains)
+    {
+        if (retired.in_use) destroy_retired_swap_chain(retired);
+    }
+
+    for (size_t i = 0; i < max_frames_in_flight; i++)
     {
         vkDestroySemaphore(device, image_available_semaphores[i], nullptr);
         vkDestroySemaphore(device, render_finished_semaphores[i], nullptr);
-        vkDestroyFence(device, in_flight_fences[i], nullptr);
     }
 
+    for (VkFence fence : in_flight_fences) vkDestroyFence(device, fence, nullptr);
+    if (frame_timeline != VK_NULL_HANDLE) vkDestroySemaphore(device, frame_timeline, nullptr);
+
+    destroy_cull_resources();
+
+    vkDestroyBuffer(device, instance_buffer, nullptr);
+    em_memory::free(instance_buffer_memory);
+    vkDestroyBuffer(device, vertex_buffer, nullptr);
+    em_memory::free(vertex_buffer_memory);
+
+    vkDestroyBuffer(device, static_draw_uniforms_buffer, nullptr);
+    em_memory::free(static_draw_uniforms_memory);
+
+    em_upload::destroy();
+    em_frame_ring::destroy();
+    vkDestroyDescriptorPool(device, descriptor_pool, nullptr);
+
+    em_workers::stop();
+    destroy_worker_command_buffers();
+
     vkDestroyCommandPool(device, command_pool, nullptr);
     
     vkDestroyPipeline(device, graphics_pipeline, nullptr);
     vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+
+    save_pipeline_cache();
+    vkDestroyPipelineCache(device, pipeline_cache, nullptr);
     vkDestroyRenderPass(device, render_pass, nullptr);
 
+    em_memory::destroy();
+
     vkDestroyDevice(device, nullptr);
-    vkDestroySurfaceKHR(vk_instance, surface, nullptr);
+    if (!headless) vkDestroySurfaceKHR(vk_instance, surface, nullptr);
     vkDestroyInstance(vk_instance, nullptr);
 
+    if (headless) return;
+
     glfwDestroyWindow(window);
 
     glfwTerminate();
 }
 
-int main()
+void parse_arguments(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if (argument == "--headless")
+        {
+            headless = true;
+        }
+        else if (argument == "--frames" && i + 1 < argc)
+        {
+            headless_frame_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (argument == "--resize-every" && i + 1 < argc)
+        {
+            headless_resize_interval = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (argument == "--pipeline-cache" && i + 1 < argc)
+        {
+            pipeline_cache_path = argv[++i];
+        }
+        else if (argument == "--frames-in-flight" && i + 1 < argc)
+        {
+            max_frames_in_flight = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (max_frames_in_flight == 0) throw std::runtime_error("At least one frame has to be in flight.");
+        }
+        else if (argument == "--swapchain-images" && i + 1 < argc)
+        {
+            requested_swap_chain_image_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (argument == "--present-mode" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+
+            if (mode == "immediate") present_mode_policy = PRESENT_POLICY_IMMEDIATE;
+            else if (mode == "mailbox") present_mode_policy = PRESENT_POLICY_MAILBOX;
+            else if (mode == "fifo") present_mode_policy = PRESENT_POLICY_FIFO;
+            else if (mode == "fifo_relaxed") present_mode_policy = PRESENT_POLICY_FIFO_RELAXED;
+            else if (mode == "auto") present_mode_policy = PRESENT_POLICY_LOWEST_LATENCY;
+            else throw std::runtime_error("Unknown present mode " + mode);
+        }
+        else if (argument == "--instances" && i + 1 < argc)
+        {
+            instance_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (instance_count == 0) throw std::runtime_error("At least one instance has to be drawn.");
+        }
+        else if (argument == "--draw-calls" && i + 1 < argc)
+        {
+            draw_call_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (draw_call_count == 0) throw std::runtime_error("At least one draw call is required.");
+        }
+        else if (argument == "--record-threads" && i + 1 < argc)
+        {
+            record_thread_count = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (argument == "--record-benchmark")
+        {
+            run_record_benchmark = true;
+        }
+        else if (argument == "--animate")
+        {
+            animate = true;
+        }
+        else if (argument == "--zoom" && i + 1 < argc)
+        {
+            view_zoom = std::stof(argv[++i]);
+            if (view_zoom <= 0.0f) throw std::runtime_error("The zoom has to be positive.");
+        }
+        else if (argument == "--gpu-driven")
+        {
+            gpu_driven_rendering = true;
+        }
+        else if (argument == "--cull-benchmark")
+        {
+            run_cull_benchmark = true;
+        }
+        else if (argument == "--overlap" && i + 1 < argc)
+        {
+            instance_overlap = std::stof(argv[++i]);
+            if (instance_overlap <= 0.0f) throw std::runtime_error("The overlap has to be positive.");
+        }
+        else if (argument == "--sort-front-to-back")
+        {
+            sort_front_to_back = true;
+        }
+        else if (argument == "--no-depth-test")
+        {
+            depth_test = false;
+        }
+        else if (argument == "--msaa" && i + 1 < argc)
+        {
+            requested_msaa_samples = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (requested_msaa_samples == 0 || requested_msaa_samples > 64 || (requested_msaa_samples & (requested_msaa_samples - 1)) != 0)
+            {
+                throw std::runtime_error("The MSAA sample count has to be 1, 2, 4, 8, 16, 32 or 64.");
+            }
+        }
+        else if (argument == "--fps-cap" && i + 1 < argc)
+        {
+            em_frame_pacer::set_target_fps(std::stod(argv[++i]));
+        }
+        else if (argument == "--max-queued-frames" && i + 1 < argc)
+        {
+            max_queued_presents = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (argument == "--legacy-render-pass")
+        {
+            force_legacy_render_pass = true;
+        }
+        else if (argument == "--render-path-benchmark")
+        {
+            run_render_path_benchmark = true;
+        }
+        else if (argument == "--resize-wait-idle")
+        {
+            resize_wait_idle = true;
+        }
+        else if (argument == "--serial-startup")
+        {
+            serial_startup = true;
+        }
+        else if (argument == "--hot-reload")
+        {
+            hot_reload_shaders = true;
+        }
+        else if (argument == "--device" && i + 1 < argc)
+        {
+            device_selection = argv[++i];
+        }
+        else if (argument == "--list-devices")
+        {
+            list_devices = true;
+        }
+        else if (argument == "--profile")
+        {
+            em_profiler::enable();
+        }
+        else if (argument == "--profile-output" && i + 1 < argc)
+        {
+            em_profiler::enable();
+            profile_output_path = argv[++i];
+        }
+        else if (argument == "--metrics-output" && i + 1 < argc)
+        {
+            em_profiler::enable();
+            metrics_output_path = argv[++i];
+        }
+        else
+        {
+            throw std::runtime_error("Unknown argument " + argument);
+        }
+    }
+
+    // Every draw call needs at least one instance.
+    draw_call_count = std::min(draw_call_count, instance_count);
+
+    const char* device_variable = std::getenv("EM_DEVICE");
+    if (device_selection.empty() && device_variable != nullptr) device_selection = device_variable;
+}
+
+int main(int argc, char** argv)
 {
-    init_window();
+    parse_arguments(argc, argv);
+
+    // Listing only needs an instance. Without a window the devices are checked for headless rendering.
+    if (list_devices)
+    {
+        headless = true;
+        create_vulkan_instance();
+        print_physical_devices();
+        vkDestroyInstance(vk_instance, nullptr);
+        return 0;
+    }
+
+    launch_time = std::chrono::steady_clock::now();
+
     init_vulkan();
 
-    start_main_loop();
+    em_profiler::record_metric("startup_ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - launch_time).count());
+
+    if (run_record_benchmark) run_recording_benchmark();
+    else if (run_render_path_benchmark) run_render_path_comparison();
+    else if (run_cull_benchmark) run_cull_comparison();
+    else start_main_loop();
 
     cleanup();
     return 0;
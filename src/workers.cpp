@@ -0,0 +1,108 @@
+#include "workers.hpp"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    std::vector<std::thread> threads;
+
+    std::mutex workers_mutex;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+
+    const std::function<void(uint32_t)>* current_job = nullptr;
+    uint64_t job_generation = 0; // Incremented for every job, so workers know when there's something new
+    uint32_t remaining_workers = 0;
+    bool stopping = false;
+
+    std::exception_ptr job_error;
+
+    void worker_main(uint32_t thread_index, uint64_t finished_generation)
+    {
+        while (true)
+        {
+            const std::function<void(uint32_t)>* job;
+
+            {
+                std::unique_lock<std::mutex> lock(workers_mutex);
+                work_available.wait(lock, [&] { return stopping || job_generation != finished_generation; });
+
+                if (stopping) return;
+
+                finished_generation = job_generation;
+                job = current_job;
+            }
+
+            try
+            {
+                (*job)(thread_index);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(workers_mutex);
+                if (!job_error) job_error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(workers_mutex);
+            if (--remaining_workers == 0) work_done.notify_one();
+        }
+    }
+}
+
+void em_workers::start(uint32_t thread_count)
+{
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    stopping = false;
+
+    // Workers only pick up jobs submitted after they were started.
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back(worker_main, i, job_generation);
+    }
+}
+
+void em_workers::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    threads.clear();
+}
+
+uint32_t em_workers::thread_count()
+{
+    return static_cast<uint32_t>(threads.size());
+}
+
+void em_workers::run(const std::function<void(uint32_t)>& job)
+{
+    std::unique_lock<std::mutex> lock(workers_mutex);
+
+    current_job = &job;
+    remaining_workers = static_cast<uint32_t>(threads.size());
+    job_generation++;
+
+    work_available.notify_all();
+    work_done.wait(lock, [] { return remaining_workers == 0; });
+
+    current_job = nullptr;
+
+    if (job_error)
+    {
+        std::exception_ptr error = job_error;
+        job_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
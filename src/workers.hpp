@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+// Small pool of worker threads, used to spread work like command buffer recording over multiple cores.
+namespace em_workers
+{
+    void start(uint32_t thread_count);
+    void stop();
+
+    uint32_t thread_count();
+
+    // Runs job(thread_index) once on every worker thread and waits until all of them are done.
+    // An exception thrown by a job is rethrown on the calling thread.
+    void run(const std::function<void(uint32_t)>& job);
+}